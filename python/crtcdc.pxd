@@ -15,6 +15,14 @@ cdef struct channel_callbacks:
   void *on_close
 
 cdef extern from "rtcdc.h":
+  cdef struct rtcdc_context:
+    pass
+
+  cdef struct rtcdc_dtls_stats:
+    unsigned long handshakes
+    unsigned long resumed
+    unsigned long cached_sessions
+
   cdef struct rtcdc_peer_connection:
     char *stun_server
     uint16_t stun_port
@@ -33,8 +41,24 @@ cdef extern from "rtcdc.h":
     void (*on_close)(rtcdc_data_channel *channel, void *user_data)
     void *user_data
 
+  rtcdc_context * \
+  rtcdc_create_context()
+
+  void \
+  rtcdc_destroy_context(rtcdc_context *ctx)
+
+  void \
+  rtcdc_get_dtls_stats(rtcdc_context *ctx, rtcdc_dtls_stats *stats)
+
+  int \
+  rtcdc_set_ice_transports(rtcdc_context *ctx, int transports)
+
+  int \
+  rtcdc_set_ice_port_range(rtcdc_context *ctx, uint16_t min_port, uint16_t max_port)
+
   rtcdc_peer_connection * \
-  rtcdc_create_peer_connection(void (*on_channel)(rtcdc_peer_connection *peer, rtcdc_data_channel *, void *user_data), \
+  rtcdc_create_peer_connection(rtcdc_context *ctx, \
+                               void (*on_channel)(rtcdc_peer_connection *peer, rtcdc_data_channel *, void *user_data), \
                                void (*on_candidate)(rtcdc_peer_connection *peer, const char *candidate, void *user_data), \
                                void (*on_connect)(rtcdc_peer_connection *peer, void *user_data), \
                                const char *stun_server, uint16_t port, void *user_data)
@@ -42,6 +66,19 @@ cdef extern from "rtcdc.h":
   void \
   rtcdc_destroy_peer_connection(rtcdc_peer_connection *peer) nogil
 
+  int \
+  rtcdc_add_turn_server(rtcdc_peer_connection *peer, const char *server, uint16_t port, \
+                        const char *username, const char *password, int type)
+
+  int \
+  rtcdc_set_ice_policy(rtcdc_peer_connection *peer, int policy)
+
+  int \
+  rtcdc_set_sctp_mode(rtcdc_peer_connection *peer, int mode)
+
+  int \
+  rtcdc_set_sctp_scheduler(rtcdc_peer_connection *peer, int scheduler)
+
   char * \
   rtcdc_generate_offer_sdp(rtcdc_peer_connection *peer)
 
@@ -51,9 +88,15 @@ cdef extern from "rtcdc.h":
   int \
   rtcdc_parse_offer_sdp(rtcdc_peer_connection *peer, const char *offer)
 
+  int \
+  rtcdc_restart_ice(rtcdc_peer_connection *peer)
+
   int \
   rtcdc_parse_candidate_sdp(rtcdc_peer_connection *peer, const char *candidates)
 
+  int \
+  rtcdc_add_remote_candidate(rtcdc_peer_connection *peer, const char *candidate)
+
   rtcdc_data_channel * \
   rtcdc_create_data_channel(rtcdc_peer_connection *peer, \
                             const char *label, const char *protocol, \
@@ -69,5 +112,23 @@ cdef extern from "rtcdc.h":
   int \
   rtcdc_send_message(rtcdc_data_channel *channel, int datatype, void *data, size_t length)
 
+  int \
+  rtcdc_set_channel_priority(rtcdc_data_channel *channel, uint16_t priority)
+
+  void \
+  rtcdc_set_log_level(int level)
+
+  int \
+  rtcdc_start_capture(rtcdc_peer_connection *peer, const char *path)
+
+  int \
+  rtcdc_start_capture_ring(rtcdc_peer_connection *peer, size_t size)
+
+  int \
+  rtcdc_dump_capture(rtcdc_peer_connection *peer, const char *path)
+
+  void \
+  rtcdc_stop_capture(rtcdc_peer_connection *peer)
+
   void \
   rtcdc_loop(rtcdc_peer_connection *peer) nogil
@@ -3,7 +3,7 @@
 # This file is licensed under a BSD license.
 
 cimport crtcdc
-from crtcdc cimport rtcdc_peer_connection, rtcdc_data_channel
+from crtcdc cimport rtcdc_context, rtcdc_peer_connection, rtcdc_data_channel
 from crtcdc cimport peer_callbacks, channel_callbacks
 from libc.stdlib cimport malloc, free
 
@@ -15,6 +15,34 @@ DATATYPE_STRING = 0
 DATATYPE_BINARY = 1
 DATATYPE_EMPTY  = 2
 
+SCTP_MODE_ONE_TO_ONE  = 0
+SCTP_MODE_ONE_TO_MANY = 1
+
+SCHEDULER_ROUND_ROBIN    = 0
+SCHEDULER_PRIORITY       = 1
+SCHEDULER_FAIR_BANDWIDTH = 2
+
+PRIORITY_BELOW_NORMAL = 128
+PRIORITY_NORMAL       = 256
+PRIORITY_HIGH         = 512
+PRIORITY_EXTRA_HIGH   = 1024
+
+TURN_UDP = 0
+TURN_TCP = 1
+TURN_TLS = 2
+
+ICE_POLICY_ALL   = 0
+ICE_POLICY_RELAY = 1
+
+LOG_NONE    = 0
+LOG_ERROR   = 1
+LOG_WARNING = 2
+LOG_INFO    = 3
+LOG_DEBUG   = 4
+
+def set_log_level(level):
+  crtcdc.rtcdc_set_log_level(level)
+
 cdef void on_channel_callback(rtcdc_peer_connection *peer, rtcdc_data_channel *channel, void *user_data) with gil:
   cdef PeerConnectionBase pc
   cdef DataChannel dc
@@ -112,9 +140,47 @@ cdef channel_callbacks *init_channel_callbacks():
   callbacks.on_close = NULL
   return callbacks
 
+cdef class Context:
+  cdef rtcdc_context *_ctx
+
+  def __cinit__(self):
+    self._ctx = crtcdc.rtcdc_create_context()
+    if self._ctx is NULL:
+      raise MemoryError()
+
+  def __dealloc__(self):
+    if self._ctx is not NULL:
+      crtcdc.rtcdc_destroy_context(self._ctx)
+      self._ctx = NULL
+
+  def dtls_stats(self):
+    cdef crtcdc.rtcdc_dtls_stats stats
+    crtcdc.rtcdc_get_dtls_stats(self._ctx, &stats)
+    return { 'handshakes': stats.handshakes, 'resumed': stats.resumed, \
+             'cached_sessions': stats.cached_sessions }
+
+  def set_ice_transports(self, transports):
+    return crtcdc.rtcdc_set_ice_transports(self._ctx, transports)
+
+  def set_ice_port_range(self, min_port, max_port):
+    return crtcdc.rtcdc_set_ice_port_range(self._ctx, min_port, max_port)
+
+_default_context = None
+
+def default_context():
+  global _default_context
+  if _default_context is None:
+    _default_context = Context()
+  return _default_context
+
 cdef  class PeerConnection(PeerConnectionBase):
-  def __cinit__(self, on_channel=None, on_candidate=None, on_connect=None, stun_server='', stun_port=0):
+  cdef Context _context
+
+  def __cinit__(self, on_channel=None, on_candidate=None, on_connect=None, stun_server='', stun_port=0, context=None):
     cdef peer_callbacks *callbacks
+    if context is None:
+      context = default_context()
+    self._context = context
     callbacks = init_peer_callbacks()
     if on_channel:
       callbacks.on_channel = <void *>on_channel
@@ -125,7 +191,8 @@ cdef  class PeerConnection(PeerConnectionBase):
     if stun_server is None:
       stun_server = ''
 
-    self._peer = crtcdc.rtcdc_create_peer_connection(on_channel_callback, \
+    self._peer = crtcdc.rtcdc_create_peer_connection(self._context._ctx, \
+                                                     on_channel_callback, \
                                                      on_candidate_callback, \
                                                      on_connect_callback, \
                                                      stun_server, stun_port, <void *>callbacks)
@@ -146,6 +213,12 @@ cdef class PeerConnectionBase:
       with nogil:
         crtcdc.rtcdc_destroy_peer_connection(self._peer)
 
+  def add_turn_server(self, char *server, port=0, char *username='', char *password='', type=TURN_UDP):
+    return crtcdc.rtcdc_add_turn_server(self._peer, server, port, username, password, type)
+
+  def set_ice_policy(self, policy):
+    return crtcdc.rtcdc_set_ice_policy(self._peer, policy)
+
   def generate_offer(self):
     return crtcdc.rtcdc_generate_offer_sdp(self._peer)
 
@@ -155,9 +228,15 @@ cdef class PeerConnectionBase:
   def parse_offer(self, char *offer):
     return crtcdc.rtcdc_parse_offer_sdp(self._peer, offer)
 
+  def restart_ice(self):
+    return crtcdc.rtcdc_restart_ice(self._peer)
+
   def parse_candidates(self, char *candidates):
     return crtcdc.rtcdc_parse_candidate_sdp(self._peer, candidates)
 
+  def add_remote_candidate(self, char *candidate):
+    return crtcdc.rtcdc_add_remote_candidate(self._peer, candidate)
+
   def create_data_channel(self, char *label, char *protocol, on_open=None, on_message=None, on_close=None):
     cdef channel_callbacks *callbacks
     callbacks = init_channel_callbacks()
@@ -172,6 +251,18 @@ cdef class PeerConnectionBase:
       raise MemoryError()
     return dc
 
+  def start_capture(self, char *path):
+    return crtcdc.rtcdc_start_capture(self._peer, path)
+
+  def start_capture_ring(self, size=0):
+    return crtcdc.rtcdc_start_capture_ring(self._peer, size)
+
+  def dump_capture(self, char *path):
+    return crtcdc.rtcdc_dump_capture(self._peer, path)
+
+  def stop_capture(self):
+    crtcdc.rtcdc_stop_capture(self._peer)
+
   @property
   def stun_server(self):
     if self._peer.stun_server is NULL:
@@ -200,6 +291,12 @@ cdef class PeerConnectionBase:
     elif name is 'on_connect':
       self._peer.on_connect = on_connect_callback
       callbacks.on_connect = <void *>value
+    elif name is 'sctp_mode':
+      if crtcdc.rtcdc_set_sctp_mode(self._peer, value) < 0:
+        raise ValueError('invalid sctp_mode or transport already created')
+    elif name is 'sctp_scheduler':
+      if crtcdc.rtcdc_set_sctp_scheduler(self._peer, value) < 0:
+        raise ValueError('invalid sctp_scheduler or transport already created')
 
 cdef class DataChannel:
   cdef rtcdc_data_channel *_channel
@@ -209,6 +306,9 @@ cdef class DataChannel:
       return -1
     return crtcdc.rtcdc_send_message(self._channel, datatype, data, len(data))
 
+  def set_priority(self, priority):
+    return crtcdc.rtcdc_set_channel_priority(self._channel, priority)
+
   @property
   def label(self):
     return self._channel.label
@@ -0,0 +1,804 @@
+// bench.c
+// Copyright (c) 2015 Xiaohan Song <chef@dark.kitchen>
+// This file is licensed under a BSD license.
+
+// Micro-benchmarks for the hot paths, built with `make bench`. The ICE
+// send cases go through real sockets on loopback, the SCTP ones through
+// two usrsctp sockets joined in-process.
+// Prints one JSON object per line:
+// {"bench":"...","param":N,"iterations":N,"ns_per_op":X}
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <glib.h>
+#include <openssl/ssl.h>
+#include <nice/agent.h>
+#include "dtls.h"
+#include "sctp.h"
+#include "dcep.h"
+#include "sdp.h"
+#include "log.h"
+#include "rtcdc.h"
+
+#ifndef BENCH_MIN_TIME_US
+#define BENCH_MIN_TIME_US 200000
+#endif
+
+// runs n operations, returns the microseconds spent on the measured part
+typedef gint64 (*bench_fn)(void *state, long n);
+
+static void
+run_bench(const char *name, long param, bench_fn fn, void *state)
+{
+  fn(state, 1); // warm up
+
+  long n = 1;
+  gint64 elapsed = 0;
+  for (;;) {
+    elapsed = fn(state, n);
+    if (elapsed >= BENCH_MIN_TIME_US || n >= (1L << 30))
+      break;
+    n *= elapsed > 0 && elapsed < BENCH_MIN_TIME_US / 100 ? 10 : 2;
+  }
+
+  printf("{\"bench\":\"%s\",\"param\":%ld,\"iterations\":%ld,\"ns_per_op\":%.1f}\n",
+         name, param, n, elapsed * 1000.0 / n);
+  fflush(stdout);
+}
+
+// DCEP runs against a peer without SCTP underneath, acks fail at once
+static struct rtcdc_peer_connection *
+create_bench_peer(void)
+{
+  struct rtcdc_peer_connection *peer =
+    (struct rtcdc_peer_connection *)calloc(1, sizeof *peer);
+  struct rtcdc_transport *transport =
+    (struct rtcdc_transport *)calloc(1, sizeof *transport);
+  struct sctp_transport *sctp = (struct sctp_transport *)calloc(1, sizeof *sctp);
+  if (peer == NULL || transport == NULL || sctp == NULL)
+    abort();
+
+  transport->sctp = sctp;
+  peer->transport = transport;
+  return peer;
+}
+
+static void
+free_bench_channel(struct rtcdc_data_channel *ch)
+{
+  free(ch->label);
+  free(ch->protocol);
+  free(ch);
+}
+
+static void
+destroy_bench_peer(struct rtcdc_peer_connection *peer)
+{
+  for (int i = 0; i < RTCDC_MAX_CHANNEL_NUM; ++i) {
+    if (peer->channels[i])
+      free_bench_channel(peer->channels[i]);
+  }
+  free(peer->transport->sctp);
+  free(peer->transport);
+  free(peer);
+}
+
+static void
+bench_on_message(struct rtcdc_data_channel *channel, int datatype,
+                 void *data, size_t len, void *user_data)
+{
+  ++*(long *)user_data;
+}
+
+struct dispatch_state {
+  struct rtcdc_peer_connection *peer;
+  uint16_t sid;
+  unsigned char data[64];
+  long delivered;
+};
+
+static gint64
+bench_dispatch(void *state, long n)
+{
+  struct dispatch_state *st = (struct dispatch_state *)state;
+  gint64 start = g_get_monotonic_time();
+  for (long i = 0; i < n; ++i)
+    handle_rtcdc_message(st->peer, st->data, sizeof st->data, WEBRTC_BINARY_PPID, st->sid);
+  return g_get_monotonic_time() - start;
+}
+
+// the message goes to the last channel, the worst case of the sid lookup
+static void
+run_dispatch_benches(void)
+{
+  static const int counts[] = { 1, 8, 32, RTCDC_MAX_CHANNEL_NUM };
+  for (int c = 0; c < sizeof counts / sizeof counts[0]; ++c) {
+    struct dispatch_state st;
+    memset(&st, 0, sizeof st);
+    st.peer = create_bench_peer();
+    for (int i = 0; i < counts[c]; ++i) {
+      struct rtcdc_data_channel *ch =
+        (struct rtcdc_data_channel *)calloc(1, sizeof *ch);
+      if (ch == NULL)
+        abort();
+      ch->sid = i * 2;
+      ch->state = RTCDC_CHANNEL_STATE_CONNECTED;
+      ch->on_message = bench_on_message;
+      ch->user_data = &st.delivered;
+      st.peer->channels[i] = ch;
+    }
+    st.sid = (counts[c] - 1) * 2;
+    run_bench("dcep_dispatch", counts[c], bench_dispatch, &st);
+    destroy_bench_peer(st.peer);
+  }
+}
+
+struct open_state {
+  struct rtcdc_peer_connection *peer;
+  unsigned char *request;
+  size_t len;
+};
+
+static gint64
+bench_open_churn(void *state, long n)
+{
+  struct open_state *st = (struct open_state *)state;
+  gint64 start = g_get_monotonic_time();
+  for (long i = 0; i < n; ++i) {
+    handle_rtcdc_message(st->peer, st->request, st->len, WEBRTC_CONTROL_PPID, 1);
+    free_bench_channel(st->peer->channels[0]);
+    st->peer->channels[0] = NULL;
+  }
+  return g_get_monotonic_time() - start;
+}
+
+static void
+run_open_bench(void)
+{
+  const char *label = "bench-channel";
+  const char *protocol = "bench";
+  size_t label_len = strlen(label), protocol_len = strlen(protocol);
+
+  struct open_state st;
+  st.len = sizeof(struct dcep_open_message) + label_len + protocol_len;
+  st.request = (unsigned char *)calloc(1, st.len);
+  if (st.request == NULL)
+    abort();
+
+  struct dcep_open_message *req = (struct dcep_open_message *)st.request;
+  req->message_type = DATA_CHANNEL_OPEN;
+  req->channel_type = DATA_CHANNEL_RELIABLE;
+  req->priority = htons(DATA_CHANNEL_PRIORITY_NORMAL);
+  req->label_length = htons(label_len);
+  req->protocol_length = htons(protocol_len);
+  memcpy(req->label_and_protocol, label, label_len);
+  memcpy(req->label_and_protocol + label_len, protocol, protocol_len);
+
+  st.peer = create_bench_peer();
+  run_bench("dcep_open_churn", 0, bench_open_churn, &st);
+  destroy_bench_peer(st.peer);
+  free(st.request);
+}
+
+struct sdp_state {
+  struct rtcdc_peer_connection *local;
+  struct rtcdc_peer_connection *remote;
+  char *offer;
+};
+
+static gint64
+bench_generate_sdp(void *state, long n)
+{
+  struct sdp_state *st = (struct sdp_state *)state;
+  gint64 start = g_get_monotonic_time();
+  for (long i = 0; i < n; ++i)
+    free(generate_local_sdp(st->local->transport, 1));
+  return g_get_monotonic_time() - start;
+}
+
+static gint64
+bench_generate_candidates(void *state, long n)
+{
+  struct sdp_state *st = (struct sdp_state *)state;
+  gint64 start = g_get_monotonic_time();
+  for (long i = 0; i < n; ++i)
+    free(generate_local_candidate_sdp(st->local->transport, 0));
+  return g_get_monotonic_time() - start;
+}
+
+static gint64
+bench_parse_sdp(void *state, long n)
+{
+  struct sdp_state *st = (struct sdp_state *)state;
+  struct sdp_description desc;
+  gint64 start = g_get_monotonic_time();
+  for (long i = 0; i < n; ++i)
+    parse_sdp(st->offer, &desc);
+  return g_get_monotonic_time() - start;
+}
+
+static gint64
+bench_parse_offer(void *state, long n)
+{
+  struct sdp_state *st = (struct sdp_state *)state;
+  gint64 start = g_get_monotonic_time();
+  for (long i = 0; i < n; ++i)
+    rtcdc_parse_offer_sdp(st->remote, st->offer);
+  return g_get_monotonic_time() - start;
+}
+
+// needs real transports: the SDP carries ICE credentials and the
+// DTLS fingerprint
+static void
+run_sdp_benches(struct rtcdc_context *ctx)
+{
+  struct sdp_state st;
+  st.local = rtcdc_create_peer_connection(ctx, NULL, NULL, NULL, NULL, 0, NULL);
+  st.remote = rtcdc_create_peer_connection(ctx, NULL, NULL, NULL, NULL, 0, NULL);
+  if (st.local == NULL || st.remote == NULL)
+    abort();
+
+  st.offer = rtcdc_generate_offer_sdp(st.local);
+  if (st.offer == NULL || rtcdc_parse_offer_sdp(st.remote, st.offer) < 0) {
+    fprintf(stderr, "bench: cannot set up SDP benchmarks\n");
+    exit(1);
+  }
+
+  // host candidates are gathered synchronously, param is their count
+  char *candidates = generate_local_candidate_sdp(st.local->transport, 0);
+  long count = 0;
+  for (char *p = candidates; p && (p = strstr(p, "\r\n")); p += 2)
+    ++count;
+  free(candidates);
+
+  run_bench("sdp_generate", 0, bench_generate_sdp, &st);
+  run_bench("sdp_generate_candidates", count, bench_generate_candidates, &st);
+  run_bench("sdp_parse", strlen(st.offer), bench_parse_sdp, &st);
+  run_bench("sdp_parse_offer", strlen(st.offer), bench_parse_offer, &st);
+
+  free(st.offer);
+  rtcdc_destroy_peer_connection(st.local);
+  rtcdc_destroy_peer_connection(st.remote);
+}
+
+struct dtls_state {
+  struct rtcdc_peer_connection client_peer;
+  struct rtcdc_peer_connection server_peer;
+  struct rtcdc_transport client_transport;
+  struct rtcdc_transport server_transport;
+  struct dtls_transport *client;
+  struct dtls_transport *server;
+  size_t size;
+  unsigned char *record;
+  unsigned char *plain;
+};
+
+// hands the datagrams written by one end to the other, NULL discards them
+static guint
+shuttle_dtls(struct dtls_transport *from, struct dtls_transport *to)
+{
+  struct dgram *batch[RTCDC_ICE_SEND_BATCH];
+  guint total = 0, n;
+  while ((n = dgram_queue_pop(from->outgoing_bio, batch, RTCDC_ICE_SEND_BATCH)) > 0) {
+    for (guint i = 0; i < n; ++i) {
+      if (to)
+        BIO_write(to->incoming_bio, batch[i]->data, batch[i]->len);
+      free(batch[i]);
+    }
+    total += n;
+  }
+  return total;
+}
+
+static int
+handshake_bench_dtls(struct dtls_state *st, struct dtls_context *context)
+{
+  st->client_peer.transport = &st->client_transport;
+  st->server_peer.transport = &st->server_transport;
+  st->client = create_dtls_transport(&st->client_peer, context);
+  st->server = create_dtls_transport(&st->server_peer, context);
+  if (st->client == NULL || st->server == NULL)
+    return -1;
+
+  // both ends share the context's certificate
+  if (set_remote_fingerprint(st->client, context->fingerprint) < 0
+      || set_remote_fingerprint(st->server, context->fingerprint) < 0)
+    return -1;
+
+  SSL_set_connect_state(st->client->ssl);
+  SSL_set_accept_state(st->server->ssl);
+  for (int i = 0; i < 64; ++i) {
+    SSL_do_handshake(st->client->ssl);
+    shuttle_dtls(st->client, st->server);
+    SSL_do_handshake(st->server->ssl);
+    shuttle_dtls(st->server, st->client);
+    if (SSL_is_init_finished(st->client->ssl) && SSL_is_init_finished(st->server->ssl))
+      return 0;
+  }
+  return -1;
+}
+
+static gint64
+bench_dtls_encrypt(void *state, long n)
+{
+  struct dtls_state *st = (struct dtls_state *)state;
+  gint64 start = g_get_monotonic_time();
+  for (long i = 0; i < n; ++i) {
+    SSL_write(st->client->ssl, st->plain, st->size);
+    shuttle_dtls(st->client, NULL);
+  }
+  return g_get_monotonic_time() - start;
+}
+
+// replay protection rejects a record seen before, so every decryption
+// gets a fresh one; only the decryption is timed
+static gint64
+bench_dtls_decrypt(void *state, long n)
+{
+  struct dtls_state *st = (struct dtls_state *)state;
+  struct dgram *out[RTCDC_ICE_SEND_BATCH];
+  gint64 elapsed = 0;
+  for (long done = 0; done < n; ) {
+    guint batch = MIN(n - done, RTCDC_ICE_SEND_BATCH);
+    guint count = 0;
+    for (guint i = 0; i < batch; ++i) {
+      SSL_write(st->client->ssl, st->plain, st->size);
+      count += dgram_queue_pop(st->client->outgoing_bio, out + count,
+                               RTCDC_ICE_SEND_BATCH - count);
+    }
+
+    gint64 start = g_get_monotonic_time();
+    for (guint i = 0; i < count; ++i) {
+      BIO_write(st->server->incoming_bio, out[i]->data, out[i]->len);
+      SSL_read(st->server->ssl, st->record, st->size);
+    }
+    elapsed += g_get_monotonic_time() - start;
+
+    for (guint i = 0; i < count; ++i)
+      free(out[i]);
+    done += batch;
+  }
+  return elapsed;
+}
+
+static void
+run_dtls_benches(struct dtls_context *context)
+{
+  static const size_t sizes[] = { 64, 256, 1024, 1200, 4096, 16000 };
+
+  struct dtls_state st;
+  memset(&st, 0, sizeof st);
+  if (handshake_bench_dtls(&st, context) < 0) {
+    fprintf(stderr, "bench: DTLS handshake failed\n");
+    exit(1);
+  }
+
+  for (int s = 0; s < sizeof sizes / sizeof sizes[0]; ++s) {
+    st.size = sizes[s];
+    st.plain = (unsigned char *)calloc(1, st.size);
+    st.record = (unsigned char *)malloc(st.size);
+    if (st.plain == NULL || st.record == NULL)
+      abort();
+    run_bench("dtls_encrypt", st.size, bench_dtls_encrypt, &st);
+    run_bench("dtls_decrypt", st.size, bench_dtls_decrypt, &st);
+    free(st.plain);
+    free(st.record);
+  }
+
+  destroy_dtls_transport(st.client);
+  destroy_dtls_transport(st.server);
+}
+
+#define IDATA_BULK_SID  1
+#define IDATA_SMALL_SID 3
+#define IDATA_CLIENT_PORT 5000
+#define IDATA_SERVER_PORT 5001
+
+// two usrsctp sockets joined in-process: each end is registered as an
+// AF_CONN address, sctp_data_ready_cb queues its packets in outgoing_bio
+struct idata_state {
+  struct sctp_transport client;
+  struct sctp_transport server;
+  struct socket *client_sock;
+  struct socket *server_sock;
+  size_t bulk_size;
+  unsigned char *bulk;
+  unsigned char small[64];
+  size_t bulk_received;
+  gboolean small_received;
+};
+
+static int
+idata_received_cb(struct socket *sock, union sctp_sockstore addr, void *data,
+                  size_t len, struct sctp_rcvinfo recv_info, int flags, void *user_data)
+{
+  struct idata_state *st = (struct idata_state *)user_data;
+  if (data && !(flags & MSG_NOTIFICATION)) {
+    if (recv_info.rcv_sid == IDATA_SMALL_SID)
+      st->small_received = TRUE;
+    else
+      st->bulk_received += len;
+  }
+  free(data);
+  return 1;
+}
+
+// FALSE if no packet was queued
+static gboolean
+shuttle_sctp_packet(struct sctp_transport *from, struct sctp_transport *to)
+{
+  struct dgram *packet;
+  g_mutex_lock(&from->sctp_mutex);
+  guint n = dgram_queue_pop(from->outgoing_bio, &packet, 1);
+  g_mutex_unlock(&from->sctp_mutex);
+  if (n == 0)
+    return FALSE;
+  usrsctp_conninput(to, packet->data, packet->len, 0);
+  free(packet);
+  return TRUE;
+}
+
+static gboolean
+shuttle_idata_pair(struct idata_state *st)
+{
+  gboolean moved = shuttle_sctp_packet(&st->client, &st->server);
+  return shuttle_sctp_packet(&st->server, &st->client) || moved;
+}
+
+// the stream scheduler the library defaults to, with or without I-DATA
+static int
+configure_idata_socket(struct socket *s, struct sctp_transport *local, uint16_t port,
+                       gboolean interleave)
+{
+  struct linger lopt;
+  lopt.l_onoff = 1;
+  lopt.l_linger = 0;
+  usrsctp_setsockopt(s, SOL_SOCKET, SO_LINGER, &lopt, sizeof lopt);
+  usrsctp_set_non_blocking(s, 1);
+
+  uint32_t on = 1;
+  usrsctp_setsockopt(s, IPPROTO_SCTP, SCTP_NODELAY, &on, sizeof on);
+  usrsctp_setsockopt(s, IPPROTO_SCTP, SCTP_RECVRCVINFO, &on, sizeof on);
+
+  struct sctp_assoc_value av;
+  av.assoc_id = SCTP_FUTURE_ASSOC;
+  av.assoc_value = SCTP_SS_ROUND_ROBIN;
+  usrsctp_setsockopt(s, IPPROTO_SCTP, SCTP_PLUGGABLE_SS, &av, sizeof av);
+  if (interleave) {
+    int level = SCTP_FRAG_LEVEL_2;
+    usrsctp_setsockopt(s, IPPROTO_SCTP, SCTP_FRAGMENT_INTERLEAVE, &level, sizeof level);
+    av.assoc_value = 1;
+    if (usrsctp_setsockopt(s, IPPROTO_SCTP, SCTP_INTERLEAVING_SUPPORTED, &av, sizeof av) < 0)
+      return -1;
+  }
+
+  struct sockaddr_conn sconn;
+  memset(&sconn, 0, sizeof sconn);
+  sconn.sconn_family = AF_CONN;
+  sconn.sconn_port = htons(port);
+  sconn.sconn_addr = local;
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+  sconn.sconn_len = sizeof sconn;
+#endif
+  return usrsctp_bind(s, (struct sockaddr *)&sconn, sizeof sconn);
+}
+
+static int
+connect_idata_pair(struct idata_state *st, gboolean interleave)
+{
+  struct sctp_transport *ends[] = { &st->client, &st->server };
+  for (int i = 0; i < 2; ++i) {
+    g_mutex_init(&ends[i]->sctp_mutex);
+    ends[i]->outgoing_bio = BIO_new(dgram_queue_method());
+    if (ends[i]->outgoing_bio == NULL)
+      return -1;
+    usrsctp_register_address(ends[i]);
+  }
+
+  st->client_sock = usrsctp_socket(AF_CONN, SOCK_STREAM, IPPROTO_SCTP, NULL, NULL, 0, NULL);
+  struct socket *listener = usrsctp_socket(AF_CONN, SOCK_STREAM, IPPROTO_SCTP,
+                                           idata_received_cb, NULL, 0, st);
+  if (st->client_sock == NULL || listener == NULL
+      || configure_idata_socket(st->client_sock, &st->client, IDATA_CLIENT_PORT, interleave) < 0
+      || configure_idata_socket(listener, &st->server, IDATA_SERVER_PORT, interleave) < 0
+      || usrsctp_listen(listener, 1) < 0) {
+    if (listener)
+      usrsctp_close(listener);
+    return -1;
+  }
+
+  struct sockaddr_conn sconn;
+  memset(&sconn, 0, sizeof sconn);
+  sconn.sconn_family = AF_CONN;
+  sconn.sconn_port = htons(IDATA_SERVER_PORT);
+  sconn.sconn_addr = &st->server;
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+  sconn.sconn_len = sizeof sconn;
+#endif
+  usrsctp_connect(st->client_sock, (struct sockaddr *)&sconn, sizeof sconn);
+
+  for (int i = 0; i < 1000 && st->server_sock == NULL; ++i) {
+    shuttle_idata_pair(st);
+    st->server_sock = usrsctp_accept(listener, NULL, NULL);
+  }
+  usrsctp_close(listener);
+  if (st->server_sock == NULL)
+    return -1;
+  uint32_t on = 1;
+  usrsctp_setsockopt(st->server_sock, IPPROTO_SCTP, SCTP_RECVRCVINFO, &on, sizeof on);
+  while (shuttle_idata_pair(st))
+    ; // COOKIE-ACK
+  return 0;
+}
+
+static void
+close_idata_pair(struct idata_state *st)
+{
+  if (st->client_sock)
+    usrsctp_close(st->client_sock);
+  if (st->server_sock)
+    usrsctp_close(st->server_sock);
+  struct sctp_transport *ends[] = { &st->client, &st->server };
+  for (int i = 0; i < 2; ++i) {
+    usrsctp_deregister_address(ends[i]);
+    if (ends[i]->outgoing_bio)
+      BIO_free_all(ends[i]->outgoing_bio);
+    g_mutex_clear(&ends[i]->sctp_mutex);
+  }
+}
+
+static int
+send_idata_message(struct idata_state *st, uint16_t sid, const void *data, size_t len)
+{
+  struct sctp_sndinfo info;
+  memset(&info, 0, sizeof info);
+  info.snd_sid = sid;
+  info.snd_ppid = htonl(WEBRTC_BINARY_PPID);
+  return usrsctp_sendv(st->client_sock, data, len, NULL, 0,
+                       &info, sizeof info, SCTP_SENDV_SNDINFO, 0) < 0 ? -1 : 0;
+}
+
+// a small message queued right behind a bulk one on another stream, timed
+// until it is delivered; packets move one at a time each way, so the time
+// covers processing whatever the sender put on the wire ahead of it
+static gint64
+bench_small_behind_bulk(void *state, long n)
+{
+  struct idata_state *st = (struct idata_state *)state;
+  gint64 elapsed = 0;
+  for (long i = 0; i < n; ++i) {
+    st->bulk_received = 0;
+    st->small_received = FALSE;
+    if (send_idata_message(st, IDATA_BULK_SID, st->bulk, st->bulk_size) < 0)
+      abort();
+
+    gint64 start = g_get_monotonic_time();
+    if (send_idata_message(st, IDATA_SMALL_SID, st->small, sizeof st->small) < 0)
+      abort();
+    while (!st->small_received)
+      shuttle_idata_pair(st); // spins through delayed SACK timers too
+    elapsed += g_get_monotonic_time() - start;
+
+    // the rest of the bulk message and the last SACKs, untimed
+    while (st->bulk_received < st->bulk_size)
+      shuttle_idata_pair(st);
+    while (shuttle_idata_pair(st))
+      ;
+  }
+  return elapsed;
+}
+
+static void
+run_idata_benches(void)
+{
+  static const size_t sizes[] = { 16384, 65536 };
+
+  for (int interleave = 0; interleave < 2; ++interleave) {
+    struct idata_state st;
+    memset(&st, 0, sizeof st);
+    if (connect_idata_pair(&st, interleave) < 0) {
+      fprintf(stderr, "bench: SCTP pair with%s I-DATA did not connect\n",
+              interleave ? "" : "out");
+      close_idata_pair(&st);
+      continue;
+    }
+
+    for (int s = 0; s < sizeof sizes / sizeof sizes[0]; ++s) {
+      st.bulk_size = sizes[s];
+      st.bulk = (unsigned char *)calloc(1, st.bulk_size);
+      if (st.bulk == NULL)
+        abort();
+      run_bench(interleave ? "sctp_small_behind_bulk_idata" : "sctp_small_behind_bulk_data",
+                st.bulk_size, bench_small_behind_bulk, &st);
+      free(st.bulk);
+    }
+    close_idata_pair(&st);
+  }
+}
+
+struct ice_send_state {
+  GMainContext *context;
+  NiceAgent *sender;
+  NiceAgent *receiver;
+  guint sender_stream;
+  guint receiver_stream;
+  size_t size;
+  unsigned char *payload;
+};
+
+static void
+bench_ice_recv(NiceAgent *agent, guint stream_id, guint component_id,
+               guint len, gchar *buf, gpointer user_data)
+{
+}
+
+// host candidates on 127.0.0.1 only, UDP as in ice_step
+static NiceAgent *
+create_loopback_agent(GMainContext *context, gboolean controlling, guint *stream_id)
+{
+  NiceAgent *agent = nice_agent_new(context, NICE_COMPATIBILITY_RFC5245);
+  if (agent == NULL)
+    return NULL;
+  g_object_set(G_OBJECT(agent), "controlling-mode", controlling, "ice-tcp", FALSE, NULL);
+
+  NiceAddress addr;
+  nice_address_init(&addr);
+  nice_address_set_from_string(&addr, "127.0.0.1");
+  nice_agent_add_local_address(agent, &addr);
+
+  *stream_id = nice_agent_add_stream(agent, 1);
+  if (*stream_id == 0
+      || !nice_agent_attach_recv(agent, *stream_id, 1, context, bench_ice_recv, NULL)
+      || !nice_agent_gather_candidates(agent, *stream_id)) {
+    g_object_unref(agent);
+    return NULL;
+  }
+  return agent;
+}
+
+static void
+signal_ice(NiceAgent *from, guint from_stream, NiceAgent *to, guint to_stream)
+{
+  gchar *ufrag = NULL, *pwd = NULL;
+  nice_agent_get_local_credentials(from, from_stream, &ufrag, &pwd);
+  nice_agent_set_remote_credentials(to, to_stream, ufrag, pwd);
+  g_free(ufrag);
+  g_free(pwd);
+
+  GSList *candidates = nice_agent_get_local_candidates(from, from_stream, 1);
+  nice_agent_set_remote_candidates(to, to_stream, 1, candidates);
+  g_slist_free_full(candidates, (GDestroyNotify)&nice_candidate_free);
+}
+
+static int
+connect_ice_pair(struct ice_send_state *st)
+{
+  st->context = g_main_context_new();
+  st->sender = create_loopback_agent(st->context, TRUE, &st->sender_stream);
+  st->receiver = create_loopback_agent(st->context, FALSE, &st->receiver_stream);
+  if (st->sender == NULL || st->receiver == NULL)
+    return -1;
+
+  signal_ice(st->sender, st->sender_stream, st->receiver, st->receiver_stream);
+  signal_ice(st->receiver, st->receiver_stream, st->sender, st->sender_stream);
+
+  gint64 deadline = g_get_monotonic_time() + 5 * G_USEC_PER_SEC;
+  while (g_get_monotonic_time() < deadline) {
+    while (g_main_context_iteration(st->context, FALSE))
+      ;
+    if (nice_agent_get_component_state(st->sender, st->sender_stream, 1)
+          == NICE_COMPONENT_STATE_READY
+        && nice_agent_get_component_state(st->receiver, st->receiver_stream, 1)
+          == NICE_COMPONENT_STATE_READY)
+      return 0;
+    g_usleep(1000);
+  }
+  return -1;
+}
+
+// the receiver reads outside the measured part, its socket never fills up
+static void
+drain_ice_pair(struct ice_send_state *st)
+{
+  while (g_main_context_iteration(st->context, FALSE))
+    ;
+}
+
+// one nice_agent_send per datagram, as ice_thread did before batching
+static gint64
+bench_ice_send_single(void *state, long n)
+{
+  struct ice_send_state *st = (struct ice_send_state *)state;
+  gint64 elapsed = 0;
+  for (long done = 0; done < n; ) {
+    long batch = MIN(n - done, RTCDC_ICE_SEND_BATCH);
+    gint64 start = g_get_monotonic_time();
+    for (long i = 0; i < batch; ++i)
+      nice_agent_send(st->sender, st->sender_stream, 1, st->size, (const gchar *)st->payload);
+    elapsed += g_get_monotonic_time() - start;
+    drain_ice_pair(st);
+    done += batch;
+  }
+  return elapsed;
+}
+
+// up to RTCDC_ICE_SEND_BATCH datagrams per call, as ice_step sends them
+static gint64
+bench_ice_send_batch(void *state, long n)
+{
+  struct ice_send_state *st = (struct ice_send_state *)state;
+  GOutputVector vectors[RTCDC_ICE_SEND_BATCH];
+  NiceOutputMessage messages[RTCDC_ICE_SEND_BATCH];
+  for (guint i = 0; i < RTCDC_ICE_SEND_BATCH; ++i) {
+    vectors[i].buffer = st->payload;
+    vectors[i].size = st->size;
+    messages[i].buffers = &vectors[i];
+    messages[i].n_buffers = 1;
+  }
+
+  gint64 elapsed = 0;
+  for (long done = 0; done < n; ) {
+    guint batch = MIN(n - done, RTCDC_ICE_SEND_BATCH);
+    gint64 start = g_get_monotonic_time();
+    nice_agent_send_messages_nonblocking(st->sender, st->sender_stream, 1,
+                                         messages, batch, NULL, NULL);
+    elapsed += g_get_monotonic_time() - start;
+    drain_ice_pair(st);
+    done += batch;
+  }
+  return elapsed;
+}
+
+// a connected libnice pair on loopback, param is the datagram size
+static void
+run_ice_send_benches(void)
+{
+  static const size_t sizes[] = { 64, 1200 };
+
+  struct ice_send_state st;
+  memset(&st, 0, sizeof st);
+  if (connect_ice_pair(&st) < 0) {
+    fprintf(stderr, "bench: ICE pair did not connect over loopback\n");
+    exit(1);
+  }
+
+  for (int s = 0; s < sizeof sizes / sizeof sizes[0]; ++s) {
+    st.size = sizes[s];
+    st.payload = (unsigned char *)calloc(1, st.size);
+    if (st.payload == NULL)
+      abort();
+    run_bench("ice_send_single", st.size, bench_ice_send_single, &st);
+    run_bench("ice_send_batch", st.size, bench_ice_send_batch, &st);
+    free(st.payload);
+  }
+
+  g_object_unref(st.sender);
+  g_object_unref(st.receiver);
+  g_main_context_unref(st.context);
+}
+
+int
+main(int argc, char *argv[])
+{
+  // DCEP acks have no SCTP socket to go to, keep that quiet
+  rtcdc_set_log_level(RTCDC_LOG_NONE);
+
+  run_dispatch_benches();
+  run_open_bench();
+
+  struct rtcdc_context *ctx = rtcdc_create_context();
+  if (ctx == NULL) {
+    fprintf(stderr, "bench: cannot create context\n");
+    return 1;
+  }
+  run_sdp_benches(ctx);
+  run_dtls_benches(ctx->dtls);
+  run_idata_benches(); // usrsctp is up while the context lives
+  rtcdc_destroy_context(ctx);
+
+  run_ice_send_benches();
+
+  return 0;
+}
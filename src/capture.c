@@ -0,0 +1,286 @@
+// capture.c
+// Copyright (c) 2015 Xiaohan Song <chef@dark.kitchen>
+// This file is licensed under a BSD license.
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "log.h"
+#include "capture.h"
+
+static void
+put16(unsigned char *p, uint16_t v)
+{
+  v = htons(v);
+  memcpy(p, &v, sizeof v);
+}
+
+static uint16_t
+ipv4_checksum(const unsigned char *hdr)
+{
+  uint32_t sum = 0;
+  for (int i = 0; i < 20; i += 2)
+    sum += (hdr[i] << 8) | hdr[i + 1];
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return ~sum & 0xffff;
+}
+
+// pcap record header followed by made up IPv4 and UDP headers,
+// 127.0.0.1 is the local end
+static void
+build_capture_header(unsigned char *hdr, const struct capture_packet *pkt)
+{
+  size_t len = pkt->len;
+  size_t caplen = MIN(len, CAPTURE_SNAPLEN - 28);
+  uint32_t rec[4];
+  rec[0] = pkt->time / G_USEC_PER_SEC;
+  rec[1] = pkt->time % G_USEC_PER_SEC;
+  rec[2] = caplen + 28;
+  rec[3] = len + 28;
+  memcpy(hdr, rec, sizeof rec);
+
+  unsigned char *ip = hdr + 16;
+  memset(ip, 0, 28);
+  ip[0] = 0x45;
+  put16(ip + 2, len + 28);
+  ip[6] = 0x40; // DF
+  ip[8] = 64;
+  ip[9] = 17; // UDP
+  uint32_t local = htonl(0x7f000001), remote = htonl(0x7f000002);
+  memcpy(ip + 12, pkt->outgoing ? &local : &remote, 4);
+  memcpy(ip + 16, pkt->outgoing ? &remote : &local, 4);
+  put16(ip + 10, ipv4_checksum(ip));
+
+  unsigned char *udp = ip + 20;
+  put16(udp, CAPTURE_UDP_PORT);
+  put16(udp + 2, CAPTURE_UDP_PORT);
+  put16(udp + 4, len + 8);
+}
+
+static int
+write_capture_header(FILE *file)
+{
+  // classic pcap, host byte order
+  uint32_t magic = 0xa1b2c3d4;
+  uint16_t version[2] = { 2, 4 };
+  uint32_t rest[4] = { 0, 0, CAPTURE_SNAPLEN, CAPTURE_LINKTYPE_IPV4 };
+  if (fwrite(&magic, sizeof magic, 1, file) != 1
+      || fwrite(version, sizeof version, 1, file) != 1
+      || fwrite(rest, sizeof rest, 1, file) != 1)
+    return -1;
+  return 0;
+}
+
+static int
+write_capture_packet(FILE *file, const struct capture_packet *pkt)
+{
+  unsigned char hdr[CAPTURE_HEADER_SIZE];
+  build_capture_header(hdr, pkt);
+  size_t caplen = MIN(pkt->len, CAPTURE_SNAPLEN - 28);
+  if (fwrite(hdr, sizeof hdr, 1, file) != 1
+      || fwrite(pkt->data, caplen, 1, file) != 1)
+    return -1;
+  return 0;
+}
+
+// takes everything queued in one lock round, the producer keeps going
+// while the batch is written out
+static gpointer
+capture_writer_thread(gpointer user_data)
+{
+  struct capture *cap = (struct capture *)user_data;
+
+  g_mutex_lock(&cap->mutex);
+  for (;;) {
+    while (g_queue_is_empty(&cap->packets) && !cap->stopping)
+      g_cond_wait(&cap->cond, &cap->mutex);
+    if (g_queue_is_empty(&cap->packets))
+      break;
+
+    GQueue batch = cap->packets;
+    g_queue_init(&cap->packets);
+    cap->bytes = 0;
+    g_mutex_unlock(&cap->mutex);
+
+    struct capture_packet *pkt;
+    gboolean failed = FALSE;
+    while ((pkt = (struct capture_packet *)g_queue_pop_head(&batch)) != NULL) {
+      if (!failed && write_capture_packet(cap->file, pkt) < 0)
+        failed = TRUE;
+      free(pkt);
+    }
+    fflush(cap->file);
+
+    g_mutex_lock(&cap->mutex);
+    if (failed && !cap->failed) {
+      cap->failed = TRUE;
+      log_warning("writing capture file failed, capture stopped");
+    }
+  }
+  g_mutex_unlock(&cap->mutex);
+
+  return NULL;
+}
+
+static struct capture *
+new_capture(size_t limit)
+{
+  struct capture *cap = (struct capture *)calloc(1, sizeof *cap);
+  if (cap == NULL)
+    return NULL;
+
+  g_mutex_init(&cap->mutex);
+  g_cond_init(&cap->cond);
+  g_queue_init(&cap->packets);
+  cap->limit = limit;
+  return cap;
+}
+
+static void
+free_capture(struct capture *cap)
+{
+  struct capture_packet *pkt;
+  while ((pkt = (struct capture_packet *)g_queue_pop_head(&cap->packets)) != NULL)
+    free(pkt);
+  if (cap->file)
+    fclose(cap->file);
+  g_cond_clear(&cap->cond);
+  g_mutex_clear(&cap->mutex);
+  free(cap);
+}
+
+struct capture *
+open_capture(const char *path, size_t limit)
+{
+  if (path == NULL)
+    return NULL;
+
+  struct capture *cap = new_capture(limit);
+  if (cap == NULL)
+    return NULL;
+
+  cap->file = fopen(path, "wb");
+  if (cap->file == NULL)
+    goto capture_err;
+
+  if (write_capture_header(cap->file) < 0)
+    goto capture_err;
+
+  cap->writer = g_thread_new("rtcdc-capture", capture_writer_thread, cap);
+  if (cap->writer == NULL)
+    goto capture_err;
+
+  if (0) {
+capture_err:
+    free_capture(cap);
+    cap = NULL;
+  }
+
+  return cap;
+}
+
+struct capture *
+open_capture_ring(size_t limit)
+{
+  return new_capture(limit);
+}
+
+void
+close_capture(struct capture *cap)
+{
+  if (cap == NULL)
+    return;
+
+  if (cap->writer) {
+    g_mutex_lock(&cap->mutex);
+    cap->stopping = TRUE;
+    g_cond_signal(&cap->cond);
+    g_mutex_unlock(&cap->mutex);
+    g_thread_join(cap->writer); // writes what is still queued
+  }
+  if (cap->dropped > 0)
+    log_info("capture dropped %lu packets", cap->dropped);
+  free_capture(cap);
+}
+
+void
+push_capture_packet(struct capture *cap, int outgoing, const void *data, size_t len)
+{
+  struct capture_packet *pkt = (struct capture_packet *)malloc(sizeof *pkt + len);
+  if (pkt == NULL)
+    return;
+  pkt->time = g_get_real_time();
+  pkt->outgoing = outgoing;
+  pkt->len = len;
+  memcpy(pkt->data, data, len);
+
+  g_mutex_lock(&cap->mutex);
+  if (cap->writer) {
+    // a writer that cannot keep up loses packets, the peer does not wait
+    if (cap->failed || cap->bytes + len > cap->limit) {
+      ++cap->dropped;
+      free(pkt);
+      pkt = NULL;
+    }
+  } else {
+    // a ring keeps the newest packets
+    while (cap->bytes + len > cap->limit && !g_queue_is_empty(&cap->packets)) {
+      struct capture_packet *old = (struct capture_packet *)g_queue_pop_head(&cap->packets);
+      cap->bytes -= old->len;
+      ++cap->dropped;
+      free(old);
+    }
+  }
+  if (pkt) {
+    g_queue_push_tail(&cap->packets, pkt);
+    cap->bytes += len;
+    if (cap->writer && cap->packets.length == 1)
+      g_cond_signal(&cap->cond);
+  }
+  g_mutex_unlock(&cap->mutex);
+}
+
+int
+take_capture_ring(struct capture *cap, GQueue *packets)
+{
+  g_queue_init(packets);
+  if (cap == NULL || cap->writer)
+    return -1;
+
+  g_mutex_lock(&cap->mutex);
+  *packets = cap->packets;
+  g_queue_init(&cap->packets);
+  cap->bytes = 0;
+  g_mutex_unlock(&cap->mutex);
+  return 0;
+}
+
+FILE *
+create_capture_file(const char *path)
+{
+  FILE *file = path ? fopen(path, "wb") : NULL;
+  if (file && write_capture_header(file) < 0) {
+    fclose(file);
+    file = NULL;
+  }
+  return file;
+}
+
+int
+dump_capture(GQueue *packets, FILE *file)
+{
+  int n = 0;
+  struct capture_packet *pkt;
+  while ((pkt = (struct capture_packet *)g_queue_pop_head(packets)) != NULL) {
+    if (n >= 0 && write_capture_packet(file, pkt) == 0)
+      ++n;
+    else
+      n = -1;
+    free(pkt);
+  }
+
+  if (fclose(file) != 0)
+    n = -1;
+  return n;
+}
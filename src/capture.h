@@ -0,0 +1,75 @@
+// capture.h
+// Copyright (c) 2015 Xiaohan Song <chef@dark.kitchen>
+// This file is licensed under a BSD license.
+
+#ifndef _RTCDC_CAPTURE_H_
+#define _RTCDC_CAPTURE_H_
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <glib.h>
+
+// SCTP packets are written as IPv4/UDP datagrams on the SCTP-over-UDP
+// port (RFC 6951), which Wireshark dissects without extra settings
+#define CAPTURE_LINKTYPE_IPV4 228
+#define CAPTURE_UDP_PORT 9899
+#define CAPTURE_HEADER_SIZE (16 + 20 + 8) // record + IPv4 + UDP
+#define CAPTURE_SNAPLEN 65535
+
+struct capture_packet {
+  gint64 time;
+  int outgoing;
+  size_t len;
+  unsigned char data[];
+};
+
+// with a file, a writer thread drains packets so the SCTP thread never
+// touches disk; without one, the newest packets are kept for dump_capture
+struct capture {
+  FILE *file;
+  GThread *writer;
+  GMutex mutex;
+  GCond cond;
+  GQueue packets;
+  size_t bytes; // payload bytes in packets
+  size_t limit;
+  gboolean stopping;
+  gboolean failed;
+  unsigned long dropped;
+};
+
+struct capture *
+open_capture(const char *path, size_t limit);
+
+struct capture *
+open_capture_ring(size_t limit);
+
+void
+close_capture(struct capture *cap);
+
+// copies the packet, never blocks on I/O
+void
+push_capture_packet(struct capture *cap, int outgoing, const void *data, size_t len);
+
+// empties a ring capture into packets
+int
+take_capture_ring(struct capture *cap, GQueue *packets);
+
+// a new pcap file with its global header written, NULL on failure
+FILE *
+create_capture_file(const char *path);
+
+// writes and frees packets taken from a ring, closes file;
+// returns the number written or -1
+int
+dump_capture(GQueue *packets, FILE *file);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif // _RTCDC_CAPTURE_H_
@@ -5,11 +5,119 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include "common.h"
+#include "log.h"
 #include "sctp.h"
 #include "dcep.h"
 #include "rtcdc.h"
 
+struct delivery_queue *
+create_delivery_queue(size_t capacity, int overflow)
+{
+  if (capacity == 0)
+    return NULL;
+
+  struct delivery_queue *q = (struct delivery_queue *)calloc(1, sizeof *q);
+  if (q == NULL)
+    return NULL;
+  q->fds[0] = q->fds[1] = -1;
+
+  q->messages = (struct queued_message *)calloc(capacity, sizeof *q->messages);
+  if (q->messages == NULL)
+    goto queue_err;
+  q->capacity = capacity;
+  q->overflow = overflow;
+
+  if (pipe(q->fds) < 0)
+    goto queue_err;
+  fcntl(q->fds[0], F_SETFL, fcntl(q->fds[0], F_GETFL) | O_NONBLOCK);
+  fcntl(q->fds[1], F_SETFL, fcntl(q->fds[1], F_GETFL) | O_NONBLOCK);
+  g_mutex_init(&q->mutex);
+
+  if (0) {
+queue_err:
+    free(q->messages);
+    free(q);
+    q = NULL;
+  }
+
+  return q;
+}
+
+void
+destroy_delivery_queue(struct delivery_queue *q)
+{
+  if (q == NULL)
+    return;
+
+  for (size_t i = 0; i < q->count; ++i)
+    free(q->messages[(q->head + i) % q->capacity].data);
+  free(q->messages);
+  close(q->fds[0]);
+  close(q->fds[1]);
+  g_mutex_clear(&q->mutex);
+  free(q);
+}
+
+static void
+clear_delivery_signal(struct delivery_queue *q)
+{
+  char buf[16];
+  while (read(q->fds[0], buf, sizeof buf) > 0)
+    ;
+  q->signaled = FALSE;
+}
+
+// takes ownership of data, dropping a message when the queue is full
+static void
+push_delivery_queue(struct delivery_queue *q, int type, void *data, size_t len)
+{
+  g_mutex_lock(&q->mutex);
+  if (q->count == q->capacity) {
+    if (q->overflow == RTCDC_OVERFLOW_DROP_NEWEST) {
+      g_mutex_unlock(&q->mutex);
+      free(data);
+      return;
+    }
+    free(q->messages[q->head].data);
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+  }
+
+  struct queued_message *m = &q->messages[(q->head + q->count) % q->capacity];
+  m->type = type;
+  m->data = data;
+  m->len = len;
+  q->count++;
+
+  if (!q->signaled) {
+    char c = 1;
+    if (write(q->fds[1], &c, 1) == 1)
+      q->signaled = TRUE;
+  }
+  g_mutex_unlock(&q->mutex);
+}
+
+int
+pop_delivery_queue(struct delivery_queue *q, struct queued_message *m)
+{
+  int ret = -1;
+  g_mutex_lock(&q->mutex);
+  if (q->count > 0) {
+    *m = q->messages[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    ret = 0;
+  }
+  if (q->count == 0 && q->signaled)
+    clear_delivery_signal(q);
+  g_mutex_unlock(&q->mutex);
+
+  return ret;
+}
+
 static struct rtcdc_data_channel *
 allocate_new_data_channel(struct dcep_open_message *open_req, uint16_t sid)
 {
@@ -56,6 +164,9 @@ handle_rtcdc_open_request(struct rtcdc_peer_connection *peer, uint16_t sid, void
     return;
   ch->sctp = peer->transport->sctp;
   peer->channels[i] = ch;
+  // our side of the stream follows the priority the opener asked for
+  if (set_sctp_stream_priority(ch->sctp, sid, ch->priority) < 0)
+    log_warning("setting priority of SCTP stream %u failed", sid);
 
   if (peer->on_channel)
     peer->on_channel(peer, ch, peer->user_data);
@@ -63,11 +174,8 @@ handle_rtcdc_open_request(struct rtcdc_peer_connection *peer, uint16_t sid, void
   struct dcep_ack_message ack;
   ack.message_type = DATA_CHANNEL_ACK;
 
-  if (send_sctp_message(ch->sctp, &ack, sizeof ack, sid, WEBRTC_CONTROL_PPID) < 0) {
-#ifdef DEBUG_SCTP
-    fprintf(stderr, "sending DCEP ack failed\n");
-#endif
-  }
+  if (send_sctp_message(ch->sctp, &ack, sizeof ack, sid, WEBRTC_CONTROL_PPID) < 0)
+    log_warning("sending DCEP ack failed");
 }
 
 static void
@@ -87,6 +195,40 @@ handle_rtcdc_open_ack(struct rtcdc_peer_connection *peer, uint16_t sid)
 }
 
 static void
+close_rtcdc_channel(struct rtcdc_data_channel *ch)
+{
+  ch->state = RTCDC_CHANNEL_STATE_CLOSED;
+  if (ch->on_close)
+    ch->on_close(ch, ch->user_data);
+}
+
+// the association went away, on_close for every channel not closed yet
+void
+close_rtcdc_channels(struct rtcdc_peer_connection *peer)
+{
+  for (int i = 0; i < RTCDC_MAX_CHANNEL_NUM; ++i) {
+    struct rtcdc_data_channel *ch = peer->channels[i];
+    if (ch && ch->state != RTCDC_CHANNEL_STATE_CLOSED)
+      close_rtcdc_channel(ch);
+  }
+}
+
+// a message queued on sid could not be sent, the channel is closed
+// since rtcdc_send_message already reported success for it
+void
+fail_rtcdc_channel(struct rtcdc_peer_connection *peer, uint16_t sid)
+{
+  for (int i = 0; i < RTCDC_MAX_CHANNEL_NUM; ++i) {
+    struct rtcdc_data_channel *ch = peer->channels[i];
+    if (ch && ch->sid == sid) {
+      if (ch->state != RTCDC_CHANNEL_STATE_CLOSED)
+        close_rtcdc_channel(ch);
+      break;
+    }
+  }
+}
+
+static int
 handle_rtcdc_data(struct rtcdc_peer_connection *peer, uint16_t sid, int type, void *data, size_t len)
 {
   for (int i = 0; i < RTCDC_MAX_CHANNEL_NUM; ++i) {
@@ -94,16 +236,28 @@ handle_rtcdc_data(struct rtcdc_peer_connection *peer, uint16_t sid, int type, vo
     if (ch && ch->sid == sid) {
       if (ch->state == RTCDC_CHANNEL_STATE_CLOSED)
         ch->state = RTCDC_CHANNEL_STATE_CONNECTED;
+      ch->delivered = 1;
+
+      // handed to rtcdc_channel_dispatch, the receive upcall returns at once
+      if (ch->delivery) {
+        push_delivery_queue(ch->delivery, type, data, len);
+        return 1;
+      }
 
-      if (ch->on_message)
+      if (ch->on_message) {
+        int owned = ch->recv_mode == RTCDC_RECV_MODE_OWNED;
         ch->on_message(ch, type, data, len, ch->user_data);
+        return owned;
+      }
 
       break;
     }
   }
+
+  return 0;
 }
 
-void
+int
 handle_rtcdc_message(struct rtcdc_peer_connection *peer, void *data, size_t len,
                      uint32_t ppid, uint16_t sid)
 {
@@ -119,17 +273,16 @@ handle_rtcdc_message(struct rtcdc_peer_connection *peer, void *data, size_t len,
       break;
     case WEBRTC_STRING_PPID:
     case WEBRTC_STRING_PARTIAL_PPID:
-      handle_rtcdc_data(peer, sid, RTCDC_DATATYPE_STRING, data, len);
-      break;
+      return handle_rtcdc_data(peer, sid, RTCDC_DATATYPE_STRING, data, len);
     case WEBRTC_BINARY_PPID:
     case WEBRTC_BINARY_PARTIAL_PPID:
-      handle_rtcdc_data(peer, sid, RTCDC_DATATYPE_BINARY, data, len);
-      break;
+      return handle_rtcdc_data(peer, sid, RTCDC_DATATYPE_BINARY, data, len);
     case WEBRTC_STRING_EMPTY_PPID:
     case WEBRTC_BINARY_EMPTY_PPID:
-      handle_rtcdc_data(peer, sid, RTCDC_DATATYPE_EMPTY, data, len);
-      break;
+      return handle_rtcdc_data(peer, sid, RTCDC_DATATYPE_EMPTY, data, len);
     default:
       break;
   }
+
+  return 0;
 }
@@ -10,6 +10,8 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
+#include <glib.h>
 
 #define WEBRTC_CONTROL_PPID        50
 #define WEBRTC_STRING_PPID         51
@@ -50,7 +52,41 @@ struct dcep_ack_message {
   uint8_t message_type;
 } __attribute__((packed, aligned(1)));
 
+struct queued_message {
+  int type;
+  void *data;
+  size_t len;
+};
+
+// bounded per-channel queue for on_message, decoupled from the SCTP upcall
+struct delivery_queue {
+  struct queued_message *messages;
+  size_t capacity;
+  size_t head;
+  size_t count;
+  int overflow;
+  int fds[2]; // fds[0] is readable while messages are queued
+  gboolean signaled;
+  GMutex mutex;
+};
+
+struct delivery_queue *
+create_delivery_queue(size_t capacity, int overflow);
+
 void
+destroy_delivery_queue(struct delivery_queue *q);
+
+int
+pop_delivery_queue(struct delivery_queue *q, struct queued_message *m);
+
+void
+close_rtcdc_channels(struct rtcdc_peer_connection *peer);
+
+void
+fail_rtcdc_channel(struct rtcdc_peer_connection *peer, uint16_t sid);
+
+// returns 1 when the application took ownership of data
+int
 handle_rtcdc_message(struct rtcdc_peer_connection *peer, void *data, size_t len,
                      uint32_t ppid, uint16_t sid);
 
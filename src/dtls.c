@@ -4,6 +4,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <openssl/bio.h>
 #include <openssl/err.h>
 #include <openssl/pem.h>
@@ -11,6 +12,7 @@
 #include <openssl/rsa.h>
 #include <openssl/crypto.h>
 #include "common.h"
+#include "log.h"
 #include "dtls.h"
 #include "rtcdc.h"
 
@@ -81,12 +83,196 @@ cert_err:
   return x509;
 }
 
+// self-signed certificates are fine, the peer is identified by the
+// a=fingerprint of its SDP instead of a chain
 static int
 verify_peer_certificate_cb(int ok, X509_STORE_CTX *ctx)
 {
+  if (X509_STORE_CTX_get_error_depth(ctx) > 0)
+    return 1;
+
+  SSL *ssl = X509_STORE_CTX_get_ex_data(ctx, SSL_get_ex_data_X509_STORE_CTX_idx());
+  struct dtls_transport *dtls = ssl ? (struct dtls_transport *)SSL_get_app_data(ssl) : NULL;
+  X509 *cert = X509_STORE_CTX_get_current_cert(ctx);
+  if (dtls == NULL || cert == NULL || !dtls->has_remote_fingerprint)
+    goto verify_err;
+
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int len;
+  if (!X509_digest(cert, EVP_sha256(), md, &len) || len != SHA256_DIGEST_SIZE
+      || memcmp(md, dtls->remote_fingerprint, SHA256_DIGEST_SIZE) != 0)
+    goto verify_err;
+
+  return 1;
+
+verify_err:
+  log_warning("DTLS peer certificate does not match the SDP fingerprint");
+  if (dtls)
+    dtls->handshake_failed = TRUE;
+  return 0;
+}
+
+// memory BIO keeping one entry per write, datagrams are never merged or split.
+// The queue has its own lock so I/O threads can feed and drain it while a
+// handshake step holds dtls_mutex for the SSL
+struct dgram_queue {
+  GQueue packets;
+  size_t pending;
+  GMutex lock;
+};
+
+static int
+dgram_queue_write(BIO *b, const char *data, int len)
+{
+  struct dgram_queue *q = (struct dgram_queue *)BIO_get_data(b);
+  BIO_clear_retry_flags(b);
+  if (len <= 0)
+    return 0;
+
+  struct dgram *d = (struct dgram *)malloc(sizeof *d + len);
+  if (d == NULL)
+    return -1;
+  d->len = len;
+  memcpy(d->data, data, len);
+  g_mutex_lock(&q->lock);
+  g_queue_push_tail(&q->packets, d);
+  q->pending += len;
+  g_mutex_unlock(&q->lock);
+  return len;
+}
+
+static int
+dgram_queue_read(BIO *b, char *data, int len)
+{
+  struct dgram_queue *q = (struct dgram_queue *)BIO_get_data(b);
+  BIO_clear_retry_flags(b);
+  g_mutex_lock(&q->lock);
+  struct dgram *d = (struct dgram *)g_queue_pop_head(&q->packets);
+  if (d)
+    q->pending -= d->len;
+  g_mutex_unlock(&q->lock);
+  if (d == NULL) {
+    BIO_set_retry_read(b);
+    return -1;
+  }
+
+  // truncated like recv() into a short buffer
+  int nbytes = d->len < (size_t)len ? (int)d->len : len;
+  memcpy(data, d->data, nbytes);
+  free(d);
+  return nbytes;
+}
+
+static long
+dgram_queue_ctrl(BIO *b, int cmd, long num, void *ptr)
+{
+  struct dgram_queue *q = (struct dgram_queue *)BIO_get_data(b);
+  switch (cmd) {
+  case BIO_CTRL_PENDING:
+    {
+      g_mutex_lock(&q->lock);
+      long pending = q->pending;
+      g_mutex_unlock(&q->lock);
+      return pending;
+    }
+  case BIO_CTRL_WPENDING:
+    return 0;
+  case BIO_CTRL_FLUSH:
+    return 1;
+  case BIO_CTRL_RESET:
+    {
+      GQueue packets;
+      g_mutex_lock(&q->lock);
+      packets = q->packets;
+      g_queue_init(&q->packets);
+      q->pending = 0;
+      g_mutex_unlock(&q->lock);
+      struct dgram *d;
+      while ((d = (struct dgram *)g_queue_pop_head(&packets)) != NULL)
+        free(d);
+      return 1;
+    }
+  default:
+    return 0;
+  }
+}
+
+static int
+dgram_queue_create(BIO *b)
+{
+  struct dgram_queue *q = (struct dgram_queue *)calloc(1, sizeof *q);
+  if (q == NULL)
+    return 0;
+  g_queue_init(&q->packets);
+  g_mutex_init(&q->lock);
+  BIO_set_data(b, q);
+  BIO_set_init(b, 1);
+  return 1;
+}
+
+static int
+dgram_queue_destroy(BIO *b)
+{
+  struct dgram_queue *q = (struct dgram_queue *)BIO_get_data(b);
+  if (q == NULL)
+    return 0;
+
+  dgram_queue_ctrl(b, BIO_CTRL_RESET, 0, NULL);
+  g_mutex_clear(&q->lock);
+  free(q);
+  BIO_set_data(b, NULL);
   return 1;
 }
 
+const BIO_METHOD *
+dgram_queue_method(void)
+{
+  static BIO_METHOD *method = NULL;
+  if (g_once_init_enter(&method)) {
+    BIO_METHOD *m = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "dgram queue");
+    BIO_meth_set_write(m, dgram_queue_write);
+    BIO_meth_set_read(m, dgram_queue_read);
+    BIO_meth_set_ctrl(m, dgram_queue_ctrl);
+    BIO_meth_set_create(m, dgram_queue_create);
+    BIO_meth_set_destroy(m, dgram_queue_destroy);
+    g_once_init_leave(&method, (gsize)m);
+  }
+  return method;
+}
+
+// hands out up to max queued datagrams, the caller free()s each of them
+guint
+dgram_queue_pop(BIO *bio, struct dgram **out, guint max)
+{
+  struct dgram_queue *q = (struct dgram_queue *)BIO_get_data(bio);
+  guint n = 0;
+  g_mutex_lock(&q->lock);
+  while (n < max && (out[n] = (struct dgram *)g_queue_pop_head(&q->packets)) != NULL)
+    q->pending -= out[n++]->len;
+  g_mutex_unlock(&q->lock);
+  return n;
+}
+
+static void
+dtls_handshake_worker(gpointer data, gpointer user_data)
+{
+  struct dtls_transport *dtls = (struct dtls_transport *)data;
+
+  g_mutex_lock(&dtls->dtls_mutex);
+  if (!dtls->handshake_done && !dtls->handshake_failed) {
+    SSL_do_handshake(dtls->ssl);
+    if (SSL_is_init_finished(dtls->ssl))
+      dtls->handshake_done = TRUE;
+  }
+  GMainContext *wakeup = dtls->wakeup;
+  g_mutex_unlock(&dtls->dtls_mutex);
+
+  // destroy_dtls_transport may free dtls as soon as the flag drops
+  g_atomic_int_set(&dtls->handshake_pending, 0);
+  if (wakeup)
+    g_main_context_wakeup(wakeup);
+}
+
 struct dtls_context *
 create_dtls_context(const char *common)
 {
@@ -112,6 +298,20 @@ create_dtls_context(const char *common)
   SSL_CTX_set_read_ahead(ctx, 1); // for DTLS
   SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, verify_peer_certificate_cb);
 
+  // resumption: bounded server cache plus tickets, clients use context->sessions
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(ctx, RTCDC_DTLS_SESSION_CACHE_SIZE);
+  SSL_CTX_set_session_id_context(ctx, (const unsigned char *)common, strlen(common));
+  context->sessions = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify)SSL_SESSION_free);
+  g_queue_init(&context->session_order);
+  g_mutex_init(&context->session_mutex);
+
+  context->crypto_pool = g_thread_pool_new(dtls_handshake_worker, NULL,
+                                           RTCDC_MAX_CRYPTO_THREADS, FALSE, NULL);
+  if (context->crypto_pool == NULL)
+    goto ctx_err;
+
   EVP_PKEY *key = gen_key();
   if (key == NULL)
     goto ctx_err;
@@ -138,7 +338,13 @@ create_dtls_context(const char *common)
 
   if (0) {
 ctx_err:
+    if (context->crypto_pool)
+      g_thread_pool_free(context->crypto_pool, FALSE, TRUE);
     SSL_CTX_free(ctx);
+    if (context->sessions) {
+      g_hash_table_destroy(context->sessions);
+      g_mutex_clear(&context->session_mutex);
+    }
     free(context);
     context = NULL;
   }
@@ -152,7 +358,11 @@ destroy_dtls_context(struct dtls_context *context)
   if (context == NULL)
     return;
 
+  g_thread_pool_free(context->crypto_pool, FALSE, TRUE);
   SSL_CTX_free(context->ctx);
+  g_queue_clear(&context->session_order);
+  g_hash_table_destroy(context->sessions);
+  g_mutex_clear(&context->session_mutex);
   free(context);
   context = NULL;
 }
@@ -180,13 +390,14 @@ create_dtls_transport(struct rtcdc_peer_connection *peer,
   BIO_set_mem_eof_return(bio, -1);
   dtls->incoming_bio = bio;
 
-  bio = BIO_new(BIO_s_mem());
+  bio = BIO_new(dgram_queue_method());
   if (bio == NULL)
     goto trans_err;
-  BIO_set_mem_eof_return(bio, -1);
   dtls->outgoing_bio = bio;
 
   SSL_set_bio(dtls->ssl, dtls->incoming_bio, dtls->outgoing_bio);
+  SSL_set_app_data(dtls->ssl, dtls);
+  dtls->crypto_pool = context->crypto_pool;
 
   EC_KEY *ecdh = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
   SSL_set_options(dtls->ssl, SSL_OP_SINGLE_ECDH_USE);
@@ -210,7 +421,203 @@ destroy_dtls_transport(struct dtls_transport *dtls)
   if (dtls == NULL)
     return;
 
+  // a queued handshake step still references dtls
+  g_atomic_int_set(&dtls->closing, 1);
+  while (g_atomic_int_get(&dtls->handshake_pending))
+    g_usleep(2500);
+
   SSL_free(dtls->ssl);
   free(dtls);
   dtls = NULL;
 }
+
+// parsed once into the binary digest compared during the handshake
+int
+set_remote_fingerprint(struct dtls_transport *dtls, const char *fingerprint)
+{
+  if (dtls == NULL || fingerprint == NULL)
+    return -1;
+
+  unsigned char md[SHA256_DIGEST_SIZE];
+  const char *p = fingerprint;
+  for (int i = 0; i < SHA256_DIGEST_SIZE; ++i) {
+    unsigned int byte;
+    if (sscanf(p, "%2x", &byte) != 1)
+      return -1;
+    md[i] = byte;
+    p += 2;
+    if (i < SHA256_DIGEST_SIZE - 1 && *p++ != ':')
+      return -1;
+  }
+  if (*p != 0)
+    return -1;
+
+  g_mutex_lock(&dtls->dtls_mutex);
+  memcpy(dtls->remote_fingerprint, md, sizeof md);
+  dtls->has_remote_fingerprint = TRUE;
+  g_mutex_unlock(&dtls->dtls_mutex);
+
+  return 0;
+}
+
+static void
+fingerprint_key(const unsigned char *md, char *key)
+{
+  for (int i = 0; i < SHA256_DIGEST_SIZE; ++i)
+    sprintf(key + 2 * i, "%02X", md[i]);
+}
+
+static int
+match_remote_fingerprint(struct dtls_transport *dtls, X509 *cert)
+{
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int len;
+  return cert && dtls->has_remote_fingerprint
+    && X509_digest(cert, EVP_sha256(), md, &len) && len == SHA256_DIGEST_SIZE
+    && memcmp(md, dtls->remote_fingerprint, SHA256_DIGEST_SIZE) == 0;
+}
+
+// at most one step per transport is queued, later requests fold into it
+void
+schedule_dtls_handshake(struct dtls_transport *dtls)
+{
+  if (dtls == NULL || dtls->handshake_done || dtls->handshake_failed)
+    return;
+
+  if (!g_atomic_int_compare_and_exchange(&dtls->handshake_pending, 0, 1))
+    return;
+  if (g_atomic_int_get(&dtls->closing)) {
+    g_atomic_int_set(&dtls->handshake_pending, 0);
+    return;
+  }
+  g_thread_pool_push(dtls->crypto_pool, dtls, NULL);
+}
+
+void
+start_dtls_handshake(struct dtls_context *context, struct dtls_transport *dtls, int client)
+{
+  if (context == NULL || dtls == NULL)
+    return;
+
+  g_mutex_lock(&dtls->dtls_mutex);
+  if (client) {
+    // offer the last session with this peer unless one was imported
+    if (SSL_get_session(dtls->ssl) == NULL && dtls->has_remote_fingerprint) {
+      char key[2 * SHA256_DIGEST_SIZE + 1];
+      fingerprint_key(dtls->remote_fingerprint, key);
+      g_mutex_lock(&context->session_mutex);
+      SSL_SESSION *sess = g_hash_table_lookup(context->sessions, key);
+      if (sess)
+        SSL_set_session(dtls->ssl, sess);
+      g_mutex_unlock(&context->session_mutex);
+    }
+    SSL_set_connect_state(dtls->ssl);
+  } else {
+    SSL_set_accept_state(dtls->ssl);
+  }
+  g_mutex_unlock(&dtls->dtls_mutex);
+
+  schedule_dtls_handshake(dtls);
+}
+
+int
+finish_dtls_handshake(struct dtls_context *context, struct dtls_transport *dtls, int client)
+{
+  if (context == NULL || dtls == NULL)
+    return -1;
+
+  g_mutex_lock(&dtls->dtls_mutex);
+  int reused = SSL_session_reused(dtls->ssl);
+  if (reused) {
+    // no certificate exchange on resumption, check the cached one instead
+    X509 *cert = SSL_get_peer_certificate(dtls->ssl);
+    int match = match_remote_fingerprint(dtls, cert);
+    X509_free(cert);
+    if (!match) {
+      dtls->handshake_failed = TRUE;
+      g_mutex_unlock(&dtls->dtls_mutex);
+      return -1;
+    }
+  }
+  SSL_SESSION *sess = client ? SSL_get1_session(dtls->ssl) : NULL;
+  g_mutex_unlock(&dtls->dtls_mutex);
+
+  g_mutex_lock(&context->session_mutex);
+  context->handshakes++;
+  if (reused)
+    context->resumed++;
+  if (sess && dtls->has_remote_fingerprint) {
+    char *key = g_malloc(2 * SHA256_DIGEST_SIZE + 1);
+    fingerprint_key(dtls->remote_fingerprint, key);
+    if (g_hash_table_lookup(context->sessions, key) == NULL)
+      g_queue_push_tail(&context->session_order, key);
+    g_hash_table_insert(context->sessions, key, sess); // keeps an existing key
+    sess = NULL;
+
+    while (g_hash_table_size(context->sessions) > RTCDC_DTLS_SESSION_CACHE_SIZE)
+      g_hash_table_remove(context->sessions, g_queue_pop_head(&context->session_order));
+  }
+  g_mutex_unlock(&context->session_mutex);
+
+  if (sess)
+    SSL_SESSION_free(sess);
+
+  return 0;
+}
+
+// DER encoded, the caller frees *data
+int
+export_dtls_session(struct dtls_transport *dtls, unsigned char **data, size_t *len)
+{
+  if (dtls == NULL || data == NULL || len == NULL)
+    return -1;
+
+  g_mutex_lock(&dtls->dtls_mutex);
+  SSL_SESSION *sess = SSL_get_session(dtls->ssl);
+  int size = sess ? i2d_SSL_SESSION(sess, NULL) : 0;
+  unsigned char *buf = size > 0 ? (unsigned char *)malloc(size) : NULL;
+  if (buf) {
+    unsigned char *p = buf;
+    i2d_SSL_SESSION(sess, &p);
+  }
+  g_mutex_unlock(&dtls->dtls_mutex);
+
+  if (buf == NULL)
+    return -1;
+
+  *data = buf;
+  *len = size;
+  return 0;
+}
+
+int
+import_dtls_session(struct dtls_transport *dtls, const unsigned char *data, size_t len)
+{
+  if (dtls == NULL || data == NULL || len == 0)
+    return -1;
+
+  const unsigned char *p = data;
+  SSL_SESSION *sess = d2i_SSL_SESSION(NULL, &p, len);
+  if (sess == NULL)
+    return -1;
+
+  g_mutex_lock(&dtls->dtls_mutex);
+  int ret = SSL_set_session(dtls->ssl, sess) == 1 ? 0 : -1;
+  g_mutex_unlock(&dtls->dtls_mutex);
+  SSL_SESSION_free(sess);
+
+  return ret;
+}
+
+void
+get_dtls_stats(struct dtls_context *context, struct rtcdc_dtls_stats *stats)
+{
+  if (context == NULL || stats == NULL)
+    return;
+
+  g_mutex_lock(&context->session_mutex);
+  stats->handshakes = context->handshakes;
+  stats->resumed = context->resumed;
+  stats->cached_sessions = g_hash_table_size(context->sessions);
+  g_mutex_unlock(&context->session_mutex);
+}
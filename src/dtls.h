@@ -14,12 +14,26 @@ extern "C" {
 #include <glib.h>
 
 #define SHA256_FINGERPRINT_SIZE (95 + 1)
+#define SHA256_DIGEST_SIZE 32
 
 struct rtcdc_peer_connection;
+struct rtcdc_dtls_stats;
+
+// one datagram held by a dgram_queue BIO
+struct dgram {
+  size_t len;
+  unsigned char data[];
+};
 
 struct dtls_context {
   SSL_CTX *ctx;
   char fingerprint[SHA256_FINGERPRINT_SIZE];
+  GHashTable *sessions; // remote fingerprint -> SSL_SESSION, client side
+  GQueue session_order;
+  GMutex session_mutex;
+  unsigned long handshakes;
+  unsigned long resumed;
+  GThreadPool *crypto_pool; // runs SSL_do_handshake off the I/O threads
 };
 
 struct dtls_transport {
@@ -27,9 +41,23 @@ struct dtls_transport {
   BIO *incoming_bio;
   BIO *outgoing_bio;
   gboolean handshake_done;
-  GMutex dtls_mutex;
+  gboolean handshake_failed;
+  gboolean closed; // close_notify or fatal alert received
+  unsigned char remote_fingerprint[SHA256_DIGEST_SIZE];
+  gboolean has_remote_fingerprint;
+  GThreadPool *crypto_pool;
+  gint handshake_pending; // a handshake step is queued on crypto_pool
+  gint closing;
+  GMainContext *wakeup; // external loop to poke when a handshake step ran
+  GMutex dtls_mutex; // the SSL, the BIO queues lock themselves
 };
 
+const BIO_METHOD *
+dgram_queue_method(void);
+
+guint
+dgram_queue_pop(BIO *bio, struct dgram **out, guint max);
+
 struct dtls_context *
 create_dtls_context(const char *common);
 
@@ -43,6 +71,27 @@ create_dtls_transport(struct rtcdc_peer_connection *peer,
 void
 destroy_dtls_transport(struct dtls_transport *dtls);
 
+int
+set_remote_fingerprint(struct dtls_transport *dtls, const char *fingerprint);
+
+void
+schedule_dtls_handshake(struct dtls_transport *dtls);
+
+void
+start_dtls_handshake(struct dtls_context *context, struct dtls_transport *dtls, int client);
+
+int
+finish_dtls_handshake(struct dtls_context *context, struct dtls_transport *dtls, int client);
+
+int
+export_dtls_session(struct dtls_transport *dtls, unsigned char **data, size_t *len);
+
+int
+import_dtls_session(struct dtls_transport *dtls, const unsigned char *data, size_t len);
+
+void
+get_dtls_stats(struct dtls_context *context, struct rtcdc_dtls_stats *stats);
+
 #ifdef  __cplusplus
 }
 #endif
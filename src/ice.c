@@ -5,10 +5,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <openssl/err.h>
 #include "common.h"
 #include "util.h"
 #include "dtls.h"
 #include "sctp.h"
+#include "resolver.h"
 #include "ice.h"
 #include "rtcdc.h"
 
@@ -28,13 +30,24 @@ static void
 component_state_changed_cb(NiceAgent *agent, guint stream_id, 
   guint component_id, guint state, gpointer user_data)
 {
-  //...
+  struct rtcdc_peer_connection *peer = (struct rtcdc_peer_connection *)user_data;
+  struct ice_transport *ice = peer->transport->ice;
+  if (ice->component_state == state)
+    return;
+  ice->component_state = state;
+
+  // FAILED also covers lost consent (keepalive-conncheck), the application
+  // can recover with rtcdc_restart_ice() instead of a new peer
+  if (peer->on_ice_state)
+    peer->on_ice_state(peer, state, peer->user_data);
 }
 
 static void
 new_local_candidate_cb(NiceAgent *agent, NiceCandidate *candidate, gpointer user_data)
 {
   struct rtcdc_peer_connection *peer = (struct rtcdc_peer_connection *)user_data;
+  if (peer->ice_policy == RTCDC_ICE_POLICY_RELAY && candidate->type != NICE_CANDIDATE_TYPE_RELAYED)
+    return;
   if (peer->on_candidate) {
     gchar *cand = nice_agent_generate_local_candidate_sdp(agent, candidate);
     peer->on_candidate(peer, cand, peer->user_data);
@@ -62,28 +75,45 @@ data_received_cb(NiceAgent *agent, guint stream_id, guint component_id,
   struct ice_transport *ice = transport->ice;
   struct dtls_transport *dtls = transport->dtls;
   struct sctp_transport *sctp = transport->sctp;
-  if (!ice->negotiation_done)
+  if (!ice->negotiation_done || dtls->handshake_failed || dtls->closed)
     return;
 
-  g_mutex_lock(&dtls->dtls_mutex);
+  // the queue locks itself, a handshake step in progress does not block this
   BIO_write(dtls->incoming_bio, buf, len);
-  g_mutex_unlock(&dtls->dtls_mutex);
-
-  if (!dtls->handshake_done && SSL_is_init_finished(dtls->ssl))
-    dtls->handshake_done = TRUE;
 
   if (!dtls->handshake_done) {
-    g_mutex_lock(&dtls->dtls_mutex);
-    SSL_do_handshake(dtls->ssl);
-    g_mutex_unlock(&dtls->dtls_mutex);
+    schedule_dtls_handshake(dtls);
   } else {
+    // a datagram may carry several records, drain them all (SSL_pending
+    // included) so bundled records reach SCTP without waiting for more traffic
     unsigned char buf[BUFFER_SIZE];
-    int nbytes = SSL_read(dtls->ssl, buf, sizeof buf);
-    if (nbytes > 0) {
-      g_mutex_lock(&sctp->sctp_mutex);
-      BIO_write(sctp->incoming_bio, buf, nbytes);
-      g_mutex_unlock(&sctp->sctp_mutex);
+    g_mutex_lock(&dtls->dtls_mutex);
+    while (!dtls->closed) {
+      int nbytes = SSL_read(dtls->ssl, buf, sizeof buf);
+      if (nbytes > 0) {
+        g_mutex_lock(&sctp->sctp_mutex);
+        BIO_write(sctp->incoming_bio, buf, nbytes);
+        g_mutex_unlock(&sctp->sctp_mutex);
+        continue;
+      }
+
+      switch (SSL_get_error(dtls->ssl, nbytes)) {
+      case SSL_ERROR_WANT_READ:
+      case SSL_ERROR_WANT_WRITE:
+        break;
+      case SSL_ERROR_ZERO_RETURN:
+        // close_notify, answer it and stop reading
+        dtls->closed = TRUE;
+        SSL_shutdown(dtls->ssl);
+        break;
+      default:
+        dtls->closed = TRUE;
+        ERR_clear_error();
+        break;
+      }
+      break;
     }
+    g_mutex_unlock(&dtls->dtls_mutex);
   }
 }
 
@@ -99,12 +129,19 @@ create_ice_transport(struct rtcdc_peer_connection *peer,
     return NULL;
   peer->transport->ice = ice;
 
-  GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+  // a context per peer, so quitting one loop wakes only its own thread;
+  // peers driven by rtcdc_process_events share the context's one
+  GMainContext *main_context = peer->ctx->main_context
+    ? g_main_context_ref(peer->ctx->main_context) : g_main_context_new();
+  GMainLoop *loop = g_main_loop_new(main_context, FALSE);
+  g_main_context_unref(main_context);
   if (loop == NULL) {
     free(ice);
     return NULL;
   }
   ice->loop = loop;
+  g_mutex_init(&ice->loop_mutex);
+  g_cond_init(&ice->loop_cond);
 
   NiceAgent *agent = nice_agent_new(g_main_loop_get_context(loop),
     NICE_COMPATIBILITY_RFC5245);
@@ -114,11 +151,25 @@ create_ice_transport(struct rtcdc_peer_connection *peer,
 
   // change the role automatically when detecting role conflict
   g_object_set(G_OBJECT(agent), "controlling-mode", 1, NULL);
+  // keepalives as binding requests, an unanswered one fails the component
+  // (consent freshness) instead of silently sending into a dead path
+  g_object_set(G_OBJECT(agent), "keepalive-conncheck", TRUE, NULL);
   if (stun_server != NULL && strcmp(stun_server, "") != 0)
     g_object_set(G_OBJECT(agent), "stun-server", stun_server, NULL);
   if (stun_port > 0)
     g_object_set(G_OBJECT(agent), "stun-server-port", stun_port, NULL);
 
+  // relay policy: no host or server reflexive candidates are gathered
+  // or paired, so the peer's address never leaves the relay
+  if (peer->ice_policy == RTCDC_ICE_POLICY_RELAY)
+    g_object_set(G_OBJECT(agent), "force-relay", TRUE, NULL);
+
+  struct rtcdc_context *ctx = peer->ctx;
+  g_object_set(G_OBJECT(agent),
+               "ice-udp", (ctx->ice_transports & RTCDC_ICE_TRANSPORT_UDP) ? TRUE : FALSE,
+               "ice-tcp", (ctx->ice_transports & RTCDC_ICE_TRANSPORT_TCP) ? TRUE : FALSE,
+               NULL);
+
   g_signal_connect(G_OBJECT(agent), "candidate-gathering-done",
     G_CALLBACK(candidate_gathering_done_cb), peer);
   g_signal_connect(G_OBJECT(agent), "component-state-changed",
@@ -135,6 +186,19 @@ create_ice_transport(struct rtcdc_peer_connection *peer,
 
   nice_agent_set_stream_name(agent, stream_id, "application");
 
+  if (ctx->ice_min_port > 0 && ctx->ice_max_port >= ctx->ice_min_port)
+    nice_agent_set_port_range(agent, stream_id, 1, ctx->ice_min_port, ctx->ice_max_port);
+
+  // relayed candidates get the lowest type preference in ICE, so TURN
+  // is only nominated when no direct or server reflexive pair works
+  for (struct ice_relay *relay = peer->relays; relay; relay = relay->next) {
+    char addr[INET6_ADDRSTRLEN];
+    if (resolver_wait(peer->ctx->resolver, relay->lookup, addr, sizeof addr) < 0)
+      continue;
+    nice_agent_set_relay_info(agent, stream_id, 1, addr, relay->port,
+                              relay->username, relay->password, relay->type);
+  }
+
   nice_agent_attach_recv(agent, stream_id, 1,
     g_main_loop_get_context(loop), data_received_cb, peer);
 
@@ -146,6 +210,8 @@ trans_err:
     peer->transport->ice = NULL;
     g_object_unref(agent);
     g_main_loop_unref(loop);
+    g_mutex_clear(&ice->loop_mutex);
+    g_cond_clear(&ice->loop_cond);
     free(ice);
     ice = NULL;
   }
@@ -161,51 +227,129 @@ destroy_ice_transport(struct ice_transport *ice)
 
   g_object_unref(ice->agent);
   g_main_loop_unref(ice->loop);
+  g_mutex_clear(&ice->loop_mutex);
+  g_cond_clear(&ice->loop_cond);
   free(ice);
   ice = NULL;
 }
 
-gpointer
-ice_thread(gpointer user_data)
+int
+add_ice_relay(struct rtcdc_peer_connection *peer, const char *server, uint16_t port,
+              const char *username, const char *password, NiceRelayType type)
+{
+  if (peer == NULL || server == NULL)
+    return -1;
+
+  struct ice_relay *relay = (struct ice_relay *)calloc(1, sizeof *relay);
+  if (relay == NULL)
+    return -1;
+
+  relay->server = strdup(server);
+  relay->port = port;
+  relay->username = strdup(username ? username : "");
+  relay->password = strdup(password ? password : "");
+  relay->type = type;
+  relay->lookup = resolver_lookup(peer->ctx->resolver, server);
+  if (relay->server == NULL || relay->username == NULL
+      || relay->password == NULL || relay->lookup == NULL) {
+    resolver_entry_unref(peer->ctx->resolver, relay->lookup);
+    free(relay->server);
+    free(relay->username);
+    free(relay->password);
+    free(relay);
+    return -1;
+  }
+
+  relay->next = peer->relays;
+  peer->relays = relay;
+  return 0;
+}
+
+void
+destroy_ice_relays(struct rtcdc_peer_connection *peer)
+{
+  if (peer == NULL)
+    return;
+
+  struct ice_relay *relay = peer->relays;
+  while (relay) {
+    struct ice_relay *next = relay->next;
+    resolver_entry_unref(peer->ctx->resolver, relay->lookup);
+    free(relay->server);
+    free(relay->username);
+    free(relay->password);
+    free(relay);
+    relay = next;
+  }
+  peer->relays = NULL;
+}
+
+int
+restart_ice_transport(struct ice_transport *ice)
+{
+  if (ice == NULL || ice->agent == NULL)
+    return -1;
+
+  // new local ufrag/pwd and no remote candidates, sockets and the
+  // selected pair stay so DTLS and SCTP keep running on top
+  if (!nice_agent_restart(ice->agent))
+    return -1;
+  memset(ice->remote_ufrag, 0, sizeof ice->remote_ufrag);
+
+  return 0;
+}
+
+// one pass of the outgoing DTLS path, returns 1 if anything was sent
+int
+ice_step(struct rtcdc_peer_connection *peer)
 {
-  struct rtcdc_peer_connection *peer = (struct rtcdc_peer_connection *)user_data;
   struct rtcdc_transport *transport = peer->transport;
   struct ice_transport *ice = transport->ice;
   struct dtls_transport *dtls = transport->dtls;
+  if (!ice->negotiation_done)
+    return 0;
 
-  while (!peer->exit_thread && !ice->gathering_done)
-    g_usleep(2500);
-  if (peer->exit_thread)
-    return NULL;
+  // records queued since the last pass leave in a single send call
+  struct dgram *batch[RTCDC_ICE_SEND_BATCH];
+  GOutputVector vectors[RTCDC_ICE_SEND_BATCH];
+  NiceOutputMessage messages[RTCDC_ICE_SEND_BATCH];
+  guint n = dgram_queue_pop(dtls->outgoing_bio, batch, RTCDC_ICE_SEND_BATCH);
+
+  if (n > 0) {
+    for (guint i = 0; i < n; ++i) {
+      vectors[i].buffer = batch[i]->data;
+      vectors[i].size = batch[i]->len;
+      messages[i].buffers = &vectors[i];
+      messages[i].n_buffers = 1;
+    }
+    // datagrams the socket refuses are dropped, DTLS and SCTP retransmit
+    nice_agent_send_messages_nonblocking(ice->agent, ice->stream_id, 1,
+                                         messages, n, NULL, NULL);
+    for (guint i = 0; i < n; ++i)
+      free(batch[i]);
+  }
 
-  while (!peer->exit_thread && !ice->negotiation_done)
+  // drives retransmission until the handshake completes
+  if (!dtls->handshake_done && !dtls->handshake_failed)
+    schedule_dtls_handshake(dtls);
+
+  return n > 0;
+}
+
+gpointer
+ice_thread(gpointer user_data)
+{
+  struct rtcdc_peer_connection *peer = (struct rtcdc_peer_connection *)user_data;
+  struct ice_transport *ice = peer->transport->ice;
+
+  while (!peer->exit_thread && !ice->gathering_done)
     g_usleep(2500);
   if (peer->exit_thread)
     return NULL;
 
-  // need an external thread to start SCTP when DTLS handshake is done
-  char buf[BUFFER_SIZE];
   while (!peer->exit_thread) {
-    if (BIO_ctrl_pending(dtls->outgoing_bio) > 0) {
-      g_mutex_lock(&dtls->dtls_mutex);
-      int nbytes = BIO_read(dtls->outgoing_bio, buf, sizeof buf);
-      g_mutex_unlock(&dtls->dtls_mutex);
-
-      if (nbytes > 0) {
-        nice_agent_send(ice->agent, ice->stream_id, 1, nbytes, buf);
-      }
-    } else {
+    if (!ice_step(peer))
       g_usleep(2500);
-    }
-
-    if (!dtls->handshake_done) {
-      g_mutex_lock(&dtls->dtls_mutex);
-      SSL_do_handshake(dtls->ssl);
-      g_mutex_unlock(&dtls->dtls_mutex);
-
-      if (SSL_is_init_finished(dtls->ssl))
-        dtls->handshake_done = TRUE;
-    }
   }
 
   return NULL;
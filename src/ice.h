@@ -12,13 +12,29 @@ extern "C" {
 #include <nice/agent.h>
 
 struct rtcdc_peer_connection;
+struct resolver_entry;
+
+struct ice_relay {
+  char *server;
+  uint16_t port;
+  char *username;
+  char *password;
+  NiceRelayType type;
+  struct resolver_entry *lookup;
+  struct ice_relay *next;
+};
 
 struct ice_transport {
   NiceAgent *agent;
   guint stream_id;
   GMainLoop *loop;
+  GMutex loop_mutex;
+  GCond loop_cond;
+  gboolean loop_running;
   gboolean gathering_done;
   gboolean negotiation_done;
+  guint component_state;
+  gchar remote_ufrag[257];
 };
 
 struct ice_transport *
@@ -28,6 +44,19 @@ create_ice_transport(struct rtcdc_peer_connection *peer,
 void
 destroy_ice_transport(struct ice_transport *ice);
 
+int
+add_ice_relay(struct rtcdc_peer_connection *peer, const char *server, uint16_t port,
+              const char *username, const char *password, NiceRelayType type);
+
+void
+destroy_ice_relays(struct rtcdc_peer_connection *peer);
+
+int
+restart_ice_transport(struct ice_transport *ice);
+
+int
+ice_step(struct rtcdc_peer_connection *peer);
+
 gpointer
 ice_thread(gpointer peer);
 
@@ -0,0 +1,41 @@
+// log.c
+// Copyright (c) 2015 Xiaohan Song <chef@dark.kitchen>
+// This file is licensed under a BSD license.
+
+#include <stdio.h>
+#include <stdarg.h>
+#include "log.h"
+
+int rtcdc_log_level = RTCDC_LOG_WARNING;
+
+static rtcdc_log_cb log_handler = NULL;
+static void *log_user_data = NULL;
+
+void
+rtcdc_set_log_level(int level)
+{
+  g_atomic_int_set(&rtcdc_log_level, level);
+}
+
+void
+rtcdc_set_log_handler(rtcdc_log_cb handler, void *user_data)
+{
+  log_user_data = user_data;
+  log_handler = handler;
+}
+
+void
+rtcdc_log(int level, const char *fmt, ...)
+{
+  char buf[512];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(buf, sizeof buf, fmt, args);
+  va_end(args);
+
+  rtcdc_log_cb handler = log_handler;
+  if (handler)
+    handler(level, buf, log_user_data);
+  else
+    fprintf(stderr, "rtcdc: %s\n", buf);
+}
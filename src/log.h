@@ -0,0 +1,41 @@
+// log.h
+// Copyright (c) 2015 Xiaohan Song <chef@dark.kitchen>
+// This file is licensed under a BSD license.
+
+#ifndef _RTCDC_LOG_H_
+#define _RTCDC_LOG_H_
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#include <glib.h>
+#include "rtcdc.h"
+
+// levels above this are compiled out entirely
+#ifndef RTCDC_LOG_MAX_LEVEL
+#define RTCDC_LOG_MAX_LEVEL RTCDC_LOG_DEBUG
+#endif
+
+extern int rtcdc_log_level;
+
+void
+rtcdc_log(int level, const char *fmt, ...) G_GNUC_PRINTF(2, 3);
+
+// a disabled level costs one predictable branch, arguments are not evaluated
+#define log_at(level, ...) \
+  do { \
+    if ((level) <= RTCDC_LOG_MAX_LEVEL && G_UNLIKELY((level) <= rtcdc_log_level)) \
+      rtcdc_log((level), __VA_ARGS__); \
+  } while (0)
+
+#define log_error(...)   log_at(RTCDC_LOG_ERROR, __VA_ARGS__)
+#define log_warning(...) log_at(RTCDC_LOG_WARNING, __VA_ARGS__)
+#define log_info(...)    log_at(RTCDC_LOG_INFO, __VA_ARGS__)
+#define log_debug(...)   log_at(RTCDC_LOG_DEBUG, __VA_ARGS__)
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif // _RTCDC_LOG_H_
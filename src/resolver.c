@@ -0,0 +1,211 @@
+// resolver.c
+// Copyright (c) 2015 Xiaohan Song <chef@dark.kitchen>
+// This file is licensed under a BSD license.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include "resolver.h"
+
+static void
+free_resolver_entry(struct resolver_entry *entry)
+{
+  free(entry->host);
+  free(entry);
+}
+
+// called with the resolver mutex held
+static void
+unref_resolver_entry(struct resolver_entry *entry)
+{
+  if (--entry->ref <= 0)
+    free_resolver_entry(entry);
+}
+
+static void
+resolve_worker(gpointer data, gpointer user_data)
+{
+  struct resolver_entry *entry = (struct resolver_entry *)data;
+  struct resolver *resolver = (struct resolver *)user_data;
+
+  char addr[INET6_ADDRSTRLEN];
+  memset(addr, 0, sizeof addr);
+  int family = AF_UNSPEC;
+
+  struct addrinfo hints, *servinfo;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_ADDRCONFIG;
+
+  if (getaddrinfo(entry->host, NULL, &hints, &servinfo) == 0) {
+    for (struct addrinfo *p = servinfo; p; p = p->ai_next) {
+      const void *src = NULL;
+      if (p->ai_family == AF_INET)
+        src = &((struct sockaddr_in *)p->ai_addr)->sin_addr;
+      else if (p->ai_family == AF_INET6)
+        src = &((struct sockaddr_in6 *)p->ai_addr)->sin6_addr;
+      if (src && inet_ntop(p->ai_family, src, addr, sizeof addr)) {
+        family = p->ai_family;
+        break;
+      }
+    }
+    freeaddrinfo(servinfo);
+  }
+
+  g_mutex_lock(&resolver->mutex);
+  if (family != AF_UNSPEC) {
+    memcpy(entry->addr, addr, sizeof addr);
+    entry->family = family;
+    entry->status = RESOLVER_DONE;
+    entry->expires = g_get_monotonic_time() + (gint64)resolver->ttl * G_USEC_PER_SEC;
+  } else {
+    entry->status = RESOLVER_FAILED;
+    // do not cache failures, the next lookup retries
+    if (g_hash_table_lookup(resolver->cache, entry->host) == entry)
+      g_hash_table_remove(resolver->cache, entry->host);
+  }
+  g_cond_broadcast(&resolver->cond);
+  unref_resolver_entry(entry); // held by the job
+  g_mutex_unlock(&resolver->mutex);
+}
+
+struct resolver *
+create_resolver(guint ttl)
+{
+  struct resolver *resolver = (struct resolver *)calloc(1, sizeof *resolver);
+  if (resolver == NULL)
+    return NULL;
+
+  resolver->ttl = ttl;
+  g_mutex_init(&resolver->mutex);
+  g_cond_init(&resolver->cond);
+  resolver->cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                          (GDestroyNotify)unref_resolver_entry);
+
+  resolver->pool = g_thread_pool_new(resolve_worker, resolver,
+                                     RESOLVER_MAX_THREADS, FALSE, NULL);
+  if (resolver->pool == NULL) {
+    destroy_resolver(resolver);
+    return NULL;
+  }
+
+  return resolver;
+}
+
+void
+destroy_resolver(struct resolver *resolver)
+{
+  if (resolver == NULL)
+    return;
+
+  // drop queued lookups, only wait for the ones in flight
+  if (resolver->pool)
+    g_thread_pool_free(resolver->pool, TRUE, TRUE);
+
+  // a dropped job never runs: fail its entry so resolver_wait returns,
+  // and release the reference the job held (cache and caller keep theirs)
+  g_mutex_lock(&resolver->mutex);
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init(&iter, resolver->cache);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    struct resolver_entry *entry = (struct resolver_entry *)value;
+    if (entry->status == RESOLVER_PENDING) {
+      entry->status = RESOLVER_FAILED;
+      unref_resolver_entry(entry);
+    }
+  }
+  g_cond_broadcast(&resolver->cond);
+  while (resolver->waiters > 0)
+    g_cond_wait(&resolver->cond, &resolver->mutex);
+  g_mutex_unlock(&resolver->mutex);
+
+  g_hash_table_destroy(resolver->cache);
+  g_mutex_clear(&resolver->mutex);
+  g_cond_clear(&resolver->cond);
+  free(resolver);
+  resolver = NULL;
+}
+
+// never blocks: returns a cached entry or one being resolved in the background
+struct resolver_entry *
+resolver_lookup(struct resolver *resolver, const char *host)
+{
+  if (resolver == NULL || host == NULL)
+    return NULL;
+
+  struct resolver_entry *entry = (struct resolver_entry *)calloc(1, sizeof *entry);
+  if (entry == NULL)
+    return NULL;
+
+  // literal addresses need no lookup and are not cached
+  unsigned char buf[sizeof(struct in6_addr)];
+  if (inet_pton(AF_INET, host, buf) == 1 || inet_pton(AF_INET6, host, buf) == 1) {
+    snprintf(entry->addr, sizeof entry->addr, "%s", host);
+    entry->family = strchr(host, ':') ? AF_INET6 : AF_INET;
+    entry->status = RESOLVER_DONE;
+    entry->ref = 1;
+    return entry;
+  }
+
+  g_mutex_lock(&resolver->mutex);
+  struct resolver_entry *cached = g_hash_table_lookup(resolver->cache, host);
+  if (cached && (cached->status == RESOLVER_PENDING
+                 || cached->expires > g_get_monotonic_time())) {
+    cached->ref++;
+    g_mutex_unlock(&resolver->mutex);
+    free(entry);
+    return cached;
+  }
+
+  entry->host = strdup(host);
+  if (entry->host == NULL) {
+    g_mutex_unlock(&resolver->mutex);
+    free(entry);
+    return NULL;
+  }
+  entry->status = RESOLVER_PENDING;
+  entry->ref = 3; // cache, job and caller
+  g_hash_table_replace(resolver->cache, entry->host, entry);
+  g_thread_pool_push(resolver->pool, entry, NULL);
+  g_mutex_unlock(&resolver->mutex);
+
+  return entry;
+}
+
+int
+resolver_wait(struct resolver *resolver, struct resolver_entry *entry,
+              char *addr, size_t len)
+{
+  if (resolver == NULL || entry == NULL)
+    return -1;
+
+  g_mutex_lock(&resolver->mutex);
+  resolver->waiters++;
+  while (entry->status == RESOLVER_PENDING)
+    g_cond_wait(&resolver->cond, &resolver->mutex);
+  int ret = entry->status == RESOLVER_DONE ? 0 : -1;
+  if (ret == 0 && addr)
+    snprintf(addr, len, "%s", entry->addr);
+  if (--resolver->waiters == 0)
+    g_cond_broadcast(&resolver->cond); // destroy_resolver may be waiting
+  g_mutex_unlock(&resolver->mutex);
+
+  return ret;
+}
+
+void
+resolver_entry_unref(struct resolver *resolver, struct resolver_entry *entry)
+{
+  if (resolver == NULL || entry == NULL)
+    return;
+
+  g_mutex_lock(&resolver->mutex);
+  unref_resolver_entry(entry);
+  g_mutex_unlock(&resolver->mutex);
+}
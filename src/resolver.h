@@ -0,0 +1,59 @@
+// resolver.h
+// Copyright (c) 2015 Xiaohan Song <chef@dark.kitchen>
+// This file is licensed under a BSD license.
+
+#ifndef _RTCDC_RESOLVER_H_
+#define _RTCDC_RESOLVER_H_
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#include <netinet/in.h>
+#include <glib.h>
+
+#define RESOLVER_MAX_THREADS 4
+
+#define RESOLVER_PENDING 0
+#define RESOLVER_DONE    1
+#define RESOLVER_FAILED  2
+
+struct resolver_entry {
+  char *host;
+  char addr[INET6_ADDRSTRLEN];
+  int family;
+  int status;
+  gint64 expires;
+  int ref;
+};
+
+struct resolver {
+  GHashTable *cache;
+  GThreadPool *pool;
+  GMutex mutex;
+  GCond cond;
+  guint ttl;
+  int waiters; // threads in resolver_wait
+};
+
+struct resolver *
+create_resolver(guint ttl);
+
+void
+destroy_resolver(struct resolver *resolver);
+
+struct resolver_entry *
+resolver_lookup(struct resolver *resolver, const char *host);
+
+int
+resolver_wait(struct resolver *resolver, struct resolver_entry *entry,
+              char *addr, size_t len);
+
+void
+resolver_entry_unref(struct resolver *resolver, struct resolver_entry *entry);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif // _RTCDC_RESOLVER_H_
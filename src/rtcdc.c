@@ -5,25 +5,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <netdb.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 #include <glib.h>
 #include "ice.h"
 #include "dtls.h"
 #include "sctp.h"
 #include "sdp.h"
 #include "dcep.h"
+#include "resolver.h"
+#include "capture.h"
 #include "rtcdc.h"
 #include "common.h"
-
-static struct dtls_context *g_dtls_context = NULL;
-static int g_context_ref = 0;
+#include "log.h"
 
 static int
 create_rtcdc_transport(struct rtcdc_peer_connection *peer, int role)
 {
-  if (peer == NULL)
+  if (peer == NULL || peer->ctx == NULL)
     return -1;
 
   struct rtcdc_transport *transport =
@@ -33,13 +39,7 @@ create_rtcdc_transport(struct rtcdc_peer_connection *peer, int role)
   peer->transport = transport;
   peer->role = role;
 
-  if (g_dtls_context == NULL) {
-    g_dtls_context = create_dtls_context("librtcdc");
-    if (g_dtls_context == NULL)
-      goto ctx_null_err;
-  }
-  transport->ctx = g_dtls_context;
-  g_context_ref++;
+  transport->ctx = peer->ctx->dtls;
 
   struct dtls_transport *dtls = create_dtls_transport(peer, transport->ctx);
   if (dtls == NULL)
@@ -49,10 +49,20 @@ create_rtcdc_transport(struct rtcdc_peer_connection *peer, int role)
   if (sctp == NULL)
     goto sctp_null_err;
 
-  struct ice_transport *ice = create_ice_transport(peer, peer->stun_server, peer->stun_port);
+  char stun_addr[INET6_ADDRSTRLEN] = "";
+  if (peer->stun_lookup
+      && resolver_wait(peer->ctx->resolver, peer->stun_lookup, stun_addr, sizeof stun_addr) < 0)
+    goto ice_null_err;
+
+  struct ice_transport *ice = create_ice_transport(peer, stun_addr, peer->stun_port);
   if (ice == NULL)
     goto ice_null_err;
 
+  if (peer->ctx->main_context) {
+    dtls->wakeup = peer->ctx->main_context;
+    sctp->wakeup = peer->ctx->main_context;
+    peer->ctx->peers = g_list_prepend(peer->ctx->peers, peer);
+  }
   peer->initialized = TRUE;
 
   if (0) {
@@ -61,12 +71,6 @@ ice_null_err:
 sctp_null_err:
     destroy_dtls_transport(dtls);
 dtls_null_err:
-    if (--g_context_ref <= 0) {
-      destroy_dtls_context(g_dtls_context);
-      g_dtls_context = NULL;
-      g_context_ref = 0;
-    }
-ctx_null_err:
     peer->transport = NULL;
     free(transport);
     return -1;
@@ -88,44 +92,157 @@ destroy_rtcdc_transport(struct rtcdc_transport *transport)
   if (transport->sctp)
     destroy_sctp_transport(transport->sctp);
 
-  if (--g_context_ref <= 0) {
-    destroy_dtls_context(g_dtls_context);
-    g_dtls_context = NULL;
-    g_context_ref = 0;
-  }
-
   free(transport);
   transport = NULL;
 }
 
+struct destroy_request {
+  struct rtcdc_peer_connection *peer;
+  rtcdc_on_destroyed_cb on_destroyed;
+  void *user_data;
+};
+
+static void
+teardown_worker(gpointer data, gpointer user_data)
+{
+  struct destroy_request *req = (struct destroy_request *)data;
+  rtcdc_destroy_peer_connection(req->peer);
+  if (req->on_destroyed)
+    req->on_destroyed(req->user_data);
+  free(req);
+}
+
+// external loop mode, runs on the loop thread outside of any dispatch
+static void
+run_queued_teardowns(struct rtcdc_context *ctx)
+{
+  while (ctx->teardowns) {
+    struct destroy_request *req = (struct destroy_request *)ctx->teardowns->data;
+    ctx->teardowns = g_list_delete_link(ctx->teardowns, ctx->teardowns);
+    teardown_worker(req, NULL);
+  }
+}
+
+struct rtcdc_context *
+rtcdc_create_context(void)
+{
+  struct rtcdc_context *ctx = (struct rtcdc_context *)calloc(1, sizeof *ctx);
+  if (ctx == NULL)
+    return NULL;
+  ctx->ice_transports = RTCDC_ICE_TRANSPORT_ALL;
+  ctx->event_fd = -1;
+
+  ctx->dtls = create_dtls_context("librtcdc");
+  if (ctx->dtls == NULL)
+    goto ctx_err;
+
+  ctx->sctp = create_sctp_context();
+  if (ctx->sctp == NULL)
+    goto ctx_err;
+
+  ctx->resolver = create_resolver(RTCDC_RESOLVER_CACHE_TTL);
+  if (ctx->resolver == NULL)
+    goto ctx_err;
+
+  ctx->teardown_pool = g_thread_pool_new(teardown_worker, NULL,
+                                         RTCDC_MAX_TEARDOWN_THREADS, FALSE, NULL);
+  if (ctx->teardown_pool == NULL)
+    goto ctx_err;
+
+  if (0) {
+ctx_err:
+    destroy_resolver(ctx->resolver);
+    destroy_sctp_context(ctx->sctp);
+    destroy_dtls_context(ctx->dtls);
+    free(ctx);
+    ctx = NULL;
+  }
+
+  return ctx;
+}
+
+void
+rtcdc_destroy_context(struct rtcdc_context *ctx)
+{
+  if (ctx == NULL)
+    return;
+
+  // finish pending asynchronous teardowns first
+  g_thread_pool_free(ctx->teardown_pool, FALSE, TRUE);
+  if (ctx->main_context) {
+    run_queued_teardowns(ctx);
+    g_list_free(ctx->peers);
+    g_hash_table_destroy(ctx->watched_fds);
+    if (ctx->event_fd >= 0)
+      close(ctx->event_fd);
+    g_main_context_unref(ctx->main_context);
+  }
+  destroy_resolver(ctx->resolver);
+  destroy_sctp_context(ctx->sctp);
+  destroy_dtls_context(ctx->dtls);
+  free(ctx);
+  ctx = NULL;
+}
+
+void
+rtcdc_get_dtls_stats(struct rtcdc_context *ctx, struct rtcdc_dtls_stats *stats)
+{
+  if (ctx == NULL || stats == NULL)
+    return;
+
+  get_dtls_stats(ctx->dtls, stats);
+}
+
+int
+rtcdc_set_ice_transports(struct rtcdc_context *ctx, int transports)
+{
+  if (ctx == NULL || transports == 0 || (transports & ~RTCDC_ICE_TRANSPORT_ALL))
+    return -1;
+
+  ctx->ice_transports = transports;
+  return 0;
+}
+
+int
+rtcdc_set_ice_port_range(struct rtcdc_context *ctx, uint16_t min_port, uint16_t max_port)
+{
+  if (ctx == NULL)
+    return -1;
+  // 0, 0 lets the OS pick again
+  if ((min_port != 0 || max_port != 0) && (min_port == 0 || max_port < min_port))
+    return -1;
+
+  ctx->ice_min_port = min_port;
+  ctx->ice_max_port = max_port;
+  return 0;
+}
+
 struct rtcdc_peer_connection *
-rtcdc_create_peer_connection(rtcdc_on_channel_cb on_channel,
+rtcdc_create_peer_connection(struct rtcdc_context *ctx,
+                             rtcdc_on_channel_cb on_channel,
                              rtcdc_on_candidate_cb on_candidate,
                              rtcdc_on_connect_cb on_connect,
                              const char *stun_server, uint16_t stun_port,
                              void *user_data)
 {
-  char buf[INET_ADDRSTRLEN];
-  if (stun_server != NULL && strcmp(stun_server, "") != 0) {
-    memset(buf, 0, sizeof buf);
-    struct addrinfo hints, *servinfo;
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET;
-    
-    if ((getaddrinfo(stun_server, NULL, &hints, &servinfo)) != 0)
-      return NULL;
-
-    struct sockaddr_in *sa = (struct sockaddr_in *)servinfo->ai_addr;
-    inet_ntop(AF_INET, &(sa->sin_addr), buf, INET_ADDRSTRLEN);
-    freeaddrinfo(servinfo);
-  }
+  if (ctx == NULL)
+    return NULL;
 
   struct rtcdc_peer_connection *peer =
     (struct rtcdc_peer_connection *)calloc(1, sizeof *peer);
   if (peer == NULL)
     return NULL;
-  if (stun_server)
-    peer->stun_server = strdup(buf);
+  peer->ctx = ctx;
+  if (stun_server != NULL && strcmp(stun_server, "") != 0) {
+    // resolved in the background, only waited for when the transport is created
+    peer->stun_server = strdup(stun_server);
+    peer->stun_lookup = resolver_lookup(ctx->resolver, stun_server);
+    if (peer->stun_server == NULL || peer->stun_lookup == NULL) {
+      free(peer->stun_server);
+      free(peer);
+      return NULL;
+    }
+  }
   peer->stun_port = stun_port > 0 ? stun_port : 3478;
   peer->on_channel = on_channel;
   peer->on_candidate = on_candidate;
@@ -135,20 +252,82 @@ rtcdc_create_peer_connection(rtcdc_on_channel_cb on_channel,
   return peer;
 }
 
+static gboolean
+quit_loop_cb(gpointer user_data)
+{
+  g_main_loop_quit((GMainLoop *)user_data);
+  return FALSE;
+}
+
+// stop rtcdc_loop (if any) and wait until its threads are joined
+static void
+stop_peer_loop(struct rtcdc_peer_connection *peer)
+{
+  peer->exit_thread = TRUE;
+  if (peer->transport == NULL || peer->transport->ice == NULL)
+    return;
+
+  struct ice_transport *ice = peer->transport->ice;
+  g_mutex_lock(&ice->loop_mutex);
+  if (ice->loop_running) {
+    // an idle source is not lost if the loop has not started running yet
+    GSource *source = g_idle_source_new();
+    g_source_set_callback(source, quit_loop_cb, ice->loop, NULL);
+    g_source_attach(source, g_main_loop_get_context(ice->loop));
+    g_source_unref(source);
+
+    while (ice->loop_running)
+      g_cond_wait(&ice->loop_cond, &ice->loop_mutex);
+  }
+  g_mutex_unlock(&ice->loop_mutex);
+}
+
+// push the SCTP ABORT through DTLS and ICE before they go away
+static void
+abort_rtcdc_transport(struct rtcdc_transport *transport)
+{
+  struct ice_transport *ice = transport->ice;
+  struct dtls_transport *dtls = transport->dtls;
+  struct sctp_transport *sctp = transport->sctp;
+  if (ice == NULL || dtls == NULL || sctp == NULL)
+    return;
+
+  abort_sctp_transport(sctp);
+  if (!ice->negotiation_done || !dtls->handshake_done)
+    return;
+
+  // a handshake worker may still hold the SSL, lock order as in data_received_cb
+  char buf[BUFFER_SIZE];
+  int nbytes;
+  g_mutex_lock(&dtls->dtls_mutex);
+  g_mutex_lock(&sctp->sctp_mutex);
+  while ((nbytes = BIO_read(sctp->outgoing_bio, buf, sizeof buf)) > 0)
+    SSL_write(dtls->ssl, buf, nbytes);
+  g_mutex_unlock(&sctp->sctp_mutex);
+  g_mutex_unlock(&dtls->dtls_mutex);
+  while ((nbytes = BIO_read(dtls->outgoing_bio, buf, sizeof buf)) > 0)
+    nice_agent_send(ice->agent, ice->stream_id, 1, nbytes, buf);
+}
+
 void
 rtcdc_destroy_peer_connection(struct rtcdc_peer_connection *peer)
 {
   if (peer == NULL)
     return;
 
+  stop_peer_loop(peer);
+  if (peer->ctx->main_context)
+    peer->ctx->peers = g_list_remove(peer->ctx->peers, peer);
+
   if (peer->transport) {
-    g_main_loop_quit(peer->transport->ice->loop);
-    g_usleep(100000);
+    abort_rtcdc_transport(peer->transport);
     destroy_rtcdc_transport(peer->transport);
   }
 
   if (peer->stun_server)
     free(peer->stun_server);
+  resolver_entry_unref(peer->ctx->resolver, peer->stun_lookup);
+  destroy_ice_relays(peer);
 
   if (peer->channels) {
     for (int i = 0; i < RTCDC_MAX_CHANNEL_NUM; ++i) {
@@ -160,6 +339,128 @@ rtcdc_destroy_peer_connection(struct rtcdc_peer_connection *peer)
   peer = NULL;
 }
 
+void
+rtcdc_destroy_peer_connection_async(struct rtcdc_peer_connection *peer,
+                                    rtcdc_on_destroyed_cb on_destroyed, void *user_data)
+{
+  if (peer == NULL)
+    return;
+
+  struct destroy_request *req = (struct destroy_request *)calloc(1, sizeof *req);
+  if (req == NULL)
+    return;
+  req->peer = peer;
+  req->on_destroyed = on_destroyed;
+  req->user_data = user_data;
+
+  // threads stop polling right away, the join happens on the pool
+  peer->exit_thread = TRUE;
+  struct rtcdc_context *ctx = peer->ctx;
+  if (ctx->main_context) {
+    // the peer's sources live on the loop's context and may be dispatching
+    // right now; tear down between two rtcdc_process_events passes instead
+    ctx->peers = g_list_remove(ctx->peers, peer);
+    ctx->teardowns = g_list_append(ctx->teardowns, req);
+    ctx->busy = 1;
+    return;
+  }
+  g_thread_pool_push(ctx->teardown_pool, req, NULL);
+}
+
+int
+rtcdc_add_turn_server(struct rtcdc_peer_connection *peer,
+                      const char *server, uint16_t port,
+                      const char *username, const char *password, int type)
+{
+  if (peer == NULL || server == NULL || strcmp(server, "") == 0)
+    return -1;
+
+  // relay info is only picked up when the agent starts gathering
+  if (peer->transport)
+    return -1;
+
+  NiceRelayType relay_type;
+  if (type == RTCDC_TURN_UDP)
+    relay_type = NICE_RELAY_TYPE_TURN_UDP;
+  else if (type == RTCDC_TURN_TCP)
+    relay_type = NICE_RELAY_TYPE_TURN_TCP;
+  else if (type == RTCDC_TURN_TLS)
+    relay_type = NICE_RELAY_TYPE_TURN_TLS;
+  else
+    return -1;
+
+  if (port == 0)
+    port = type == RTCDC_TURN_TLS ? 5349 : 3478;
+
+  return add_ice_relay(peer, server, port, username, password, relay_type);
+}
+
+int
+rtcdc_set_ice_policy(struct rtcdc_peer_connection *peer, int policy)
+{
+  if (peer == NULL || peer->transport)
+    return -1;
+  if (policy != RTCDC_ICE_POLICY_ALL && policy != RTCDC_ICE_POLICY_RELAY)
+    return -1;
+
+  peer->ice_policy = policy;
+  return 0;
+}
+
+int
+rtcdc_set_sctp_mode(struct rtcdc_peer_connection *peer, int mode)
+{
+  if (peer == NULL || peer->transport)
+    return -1;
+  if (mode != RTCDC_SCTP_MODE_ONE_TO_ONE && mode != RTCDC_SCTP_MODE_ONE_TO_MANY)
+    return -1;
+
+  peer->sctp_mode = mode;
+  return 0;
+}
+
+int
+rtcdc_set_sctp_scheduler(struct rtcdc_peer_connection *peer, int scheduler)
+{
+  if (peer == NULL || peer->transport)
+    return -1;
+  if (scheduler != RTCDC_SCHEDULER_ROUND_ROBIN && scheduler != RTCDC_SCHEDULER_PRIORITY
+      && scheduler != RTCDC_SCHEDULER_FAIR_BANDWIDTH)
+    return -1;
+
+  peer->sctp_scheduler = scheduler;
+  return 0;
+}
+
+int
+rtcdc_set_on_ice_state(struct rtcdc_peer_connection *peer, rtcdc_on_ice_state_cb on_ice_state)
+{
+  // read by the ICE thread without a lock once the transport exists
+  if (peer == NULL || peer->transport)
+    return -1;
+
+  peer->on_ice_state = on_ice_state;
+  return 0;
+}
+
+int
+rtcdc_export_dtls_session(struct rtcdc_peer_connection *peer, unsigned char **data, size_t *len)
+{
+  if (peer == NULL || peer->transport == NULL || !peer->transport->dtls->handshake_done)
+    return -1;
+
+  return export_dtls_session(peer->transport->dtls, data, len);
+}
+
+int
+rtcdc_import_dtls_session(struct rtcdc_peer_connection *peer, const unsigned char *data, size_t len)
+{
+  if (peer == NULL || peer->transport == NULL)
+    return -1;
+
+  return import_dtls_session(peer->transport->dtls, data, len);
+}
+
 char *
 rtcdc_generate_offer_sdp(struct rtcdc_peer_connection *peer)
 {
@@ -184,7 +485,8 @@ rtcdc_generate_local_candidate_sdp(struct rtcdc_peer_connection *peer)
     if (create_rtcdc_transport(peer, RTCDC_PEER_ROLE_CLIENT) < 0)
       return NULL;
   }
-  return generate_local_candidate_sdp(peer->transport);
+  return generate_local_candidate_sdp(peer->transport,
+                                      peer->ice_policy == RTCDC_ICE_POLICY_RELAY);
 }
 
 int
@@ -198,37 +500,44 @@ rtcdc_parse_offer_sdp(struct rtcdc_peer_connection *peer, const char *offer)
       return -1;
   }
 
-  char **lines;
-  lines = g_strsplit(offer, "\r\n", 0);
+  struct sdp_description desc;
+  if (parse_sdp(offer, &desc) < 0)
+    return -1;
 
-  char buf[BUFFER_SIZE];
-  memset(buf, 0, sizeof buf);
-  int pos = 0;
-  int remote_port = 0;
-  for (int i = 0; lines && lines[i]; ++i) {
-    if (g_str_has_prefix(lines[i], "a=sctp-port:")) {
-      char **columns = g_strsplit(lines[i], ":", 0);
-      remote_port = atoi(columns[1]);
-      if (remote_port <= 0)
-        return -1;
-      peer->transport->sctp->remote_port = remote_port;
-      g_strfreev(columns);
-    } else if (g_str_has_prefix(lines[i], "a=setup:")) {
-      char **columns = g_strsplit(lines[i], ":", 0);
-      if (strcmp(columns[1], "active") == 0 && peer->role == RTCDC_PEER_ROLE_CLIENT) {
-        peer->role = RTCDC_PEER_ROLE_SERVER;
-      } else if (strcmp(columns[1], "passive") == 0 && peer->role == RTCDC_PEER_ROLE_SERVER) {
-        peer->role = RTCDC_PEER_ROLE_CLIENT;
-      } else { // actpass
-        // nothing to do
-      }
-      g_strfreev(columns);
-    }
-    pos += sprintf(buf + pos, "%s\n", lines[i]);
+  // without it any certificate would be accepted, refuse the offer
+  // before it changes anything; the fingerprint is only stored if valid
+  if (set_remote_fingerprint(peer->transport->dtls, desc.fingerprint) < 0)
+    return -1;
+
+  if (desc.sctp_port > 0)
+    peer->transport->sctp->remote_port = desc.sctp_port;
+  peer->transport->sctp->remote_max_message_size = desc.has_max_message_size ?
+    desc.max_message_size : RTCDC_DEFAULT_REMOTE_MAX_MESSAGE_SIZE;
+
+  // a changed ufrag on a running session is a remote ICE restart
+  struct ice_transport *ice = peer->transport->ice;
+  if (ice->remote_ufrag[0] && strcmp(ice->remote_ufrag, desc.ice_ufrag) != 0)
+    restart_ice_transport(ice);
+  snprintf(ice->remote_ufrag, sizeof ice->remote_ufrag, "%s", desc.ice_ufrag);
+
+  if (!peer->transport->dtls->handshake_done) {
+    if (desc.setup == SDP_SETUP_ACTIVE && peer->role == RTCDC_PEER_ROLE_CLIENT)
+      peer->role = RTCDC_PEER_ROLE_SERVER;
+    else if (desc.setup == SDP_SETUP_PASSIVE && peer->role == RTCDC_PEER_ROLE_SERVER)
+      peer->role = RTCDC_PEER_ROLE_CLIENT;
+    // actpass: nothing to do
   }
-  g_strfreev(lines);
 
-  return parse_remote_sdp(peer->transport->ice, buf);
+  return parse_remote_sdp(ice, &desc, offer);
+}
+
+int
+rtcdc_restart_ice(struct rtcdc_peer_connection *peer)
+{
+  if (peer == NULL || peer->transport == NULL)
+    return -1;
+
+  return restart_ice_transport(peer->transport->ice);
 }
 
 int
@@ -240,6 +549,21 @@ rtcdc_parse_candidate_sdp(struct rtcdc_peer_connection *peer, const char *candid
   return parse_remote_candidate_sdp(peer->transport->ice, candidates);
 }
 
+int
+rtcdc_add_remote_candidate(struct rtcdc_peer_connection *peer, const char *candidate)
+{
+  if (peer == NULL || candidate == NULL)
+    return -1;
+
+  // candidates may arrive before the offer, checks start once both are in
+  if (peer->transport == NULL) {
+    if (create_rtcdc_transport(peer, RTCDC_PEER_ROLE_CLIENT) < 0)
+      return -1;
+  }
+
+  return add_remote_candidate_sdp(peer->transport->ice, candidate);
+}
+
 struct rtcdc_data_channel *
 rtcdc_create_data_channel(struct rtcdc_peer_connection *peer,
                           const char *label, const char *protocol,
@@ -280,6 +604,7 @@ rtcdc_create_data_channel(struct rtcdc_peer_connection *peer,
     goto open_channel_err;
 
   ch->type = DATA_CHANNEL_RELIABLE;
+  ch->priority = DATA_CHANNEL_PRIORITY_NORMAL;
   ch->state = RTCDC_CHANNEL_STATE_CONNECTING;
   if (label)
     ch->label = strdup(label);
@@ -290,7 +615,7 @@ rtcdc_create_data_channel(struct rtcdc_peer_connection *peer,
 
   req->message_type = DATA_CHANNEL_OPEN;
   req->channel_type = ch->type;
-  req->priority = htons(0);
+  req->priority = htons(ch->priority);
   req->reliability_param = htonl(0);
   if (label)
     req->label_length = htons(strlen(label));
@@ -299,6 +624,7 @@ rtcdc_create_data_channel(struct rtcdc_peer_connection *peer,
   memcpy(req->label_and_protocol, label, strlen(label));
   memcpy(req->label_and_protocol + strlen(label), protocol, strlen(protocol));
 
+  set_sctp_stream_priority(sctp, ch->sid, ch->priority);
   int ret = send_sctp_message(sctp, req, rlen, ch->sid, WEBRTC_CONTROL_PPID);
   free(req);
   if (ret < 0)
@@ -325,12 +651,14 @@ rtcdc_destroy_data_channel(struct rtcdc_data_channel *channel)
     free(channel->label);
   if (channel->protocol)
     free(channel->protocol);
+  destroy_delivery_queue(channel->delivery);
+  channel->delivery = NULL;
 }
 
 int
 rtcdc_send_message(struct rtcdc_data_channel *channel, int datatype, void *data, size_t len)
 {
-  if (channel == NULL)
+  if (channel == NULL || channel->sctp == NULL)
     return -1;
 
   int ppid;
@@ -347,94 +675,390 @@ rtcdc_send_message(struct rtcdc_data_channel *channel, int datatype, void *data,
   } else
     return -1;
 
+  size_t max_size = channel->sctp->remote_max_message_size;
+  if (max_size > 0 && len > max_size)
+    return -1;
+
   return send_sctp_message(channel->sctp, data, len, channel->sid, ppid);
 }
 
-static gpointer
-startup_thread(gpointer user_data)
+static int
+send_stream(struct rtcdc_data_channel *channel, int datatype, size_t len,
+            rtcdc_read_cb read, int fd, rtcdc_on_sent_cb on_sent, void *user_data)
 {
-  struct rtcdc_peer_connection *peer = (struct rtcdc_peer_connection *)user_data;
-  struct rtcdc_transport *transport = peer->transport;
-  struct ice_transport *ice = transport->ice;
-  struct dtls_transport *dtls = transport->dtls;
-  struct sctp_transport *sctp = transport->sctp;
+  if (channel == NULL || channel->sctp == NULL || len == 0)
+    return -1;
 
-  while (!peer->exit_thread && !ice->negotiation_done)
-    g_usleep(2500);
-  if (peer->exit_thread)
-    return NULL;
+  uint32_t ppid;
+  if (datatype == RTCDC_DATATYPE_STRING)
+    ppid = WEBRTC_STRING_PPID;
+  else if (datatype == RTCDC_DATATYPE_BINARY)
+    ppid = WEBRTC_BINARY_PPID;
+  else
+    return -1;
 
-#ifdef DEBUG_SCTP
-  fprintf(stderr, "ICE negotiation done\n");
-#endif
+  // one SCTP message, so the remote a=max-message-size still applies
+  size_t max_size = channel->sctp->remote_max_message_size;
+  if (max_size > 0 && len > max_size)
+    return -1;
 
-  if (peer->role == RTCDC_PEER_ROLE_CLIENT)
-    SSL_set_connect_state(dtls->ssl);
-  else
-    SSL_set_accept_state(dtls->ssl);
-  SSL_do_handshake(dtls->ssl);
+  struct sctp_stream_source *src = (struct sctp_stream_source *)calloc(1, sizeof *src);
+  if (src == NULL)
+    return -1;
+  src->channel = channel;
+  src->sid = channel->sid;
+  src->ppid = ppid;
+  src->total = len;
+  src->fd = fd;
+  src->read = read;
+  src->on_sent = on_sent;
+  src->user_data = user_data;
+
+  if (send_sctp_stream(channel->sctp, src) < 0) {
+    free(src);
+    return -1;
+  }
+
+  return 0;
+}
+
+int
+rtcdc_send_stream(struct rtcdc_data_channel *channel, int datatype, size_t len,
+                  rtcdc_read_cb read, rtcdc_on_sent_cb on_sent, void *user_data)
+{
+  if (read == NULL)
+    return -1;
+
+  return send_stream(channel, datatype, len, read, -1, on_sent, user_data);
+}
+
+int
+rtcdc_send_file(struct rtcdc_data_channel *channel, int datatype, int fd,
+                rtcdc_on_sent_cb on_sent, void *user_data)
+{
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0)
+    return -1;
+
+  off_t offset = lseek(fd, 0, SEEK_CUR);
+  if (offset < 0 || offset >= st.st_size)
+    return -1;
+
+  return send_stream(channel, datatype, st.st_size - offset, NULL, fd, on_sent, user_data);
+}
+
+int
+rtcdc_set_channel_priority(struct rtcdc_data_channel *channel, uint16_t priority)
+{
+  if (channel == NULL || channel->sctp == NULL)
+    return -1;
+
+  channel->priority = priority;
+  return set_sctp_stream_priority(channel->sctp, channel->sid, priority);
+}
+
+int
+rtcdc_channel_set_recv_mode(struct rtcdc_data_channel *channel, int mode)
+{
+  // messages already handed out were freed, or not, by the old mode
+  if (channel == NULL || channel->delivered)
+    return -1;
+  if (mode != RTCDC_RECV_MODE_BORROWED && mode != RTCDC_RECV_MODE_OWNED)
+    return -1;
+
+  channel->recv_mode = mode;
+  return 0;
+}
+
+void
+rtcdc_release_message(void *data)
+{
+  free(data); // allocated by usrsctp
+}
+
+int
+rtcdc_channel_enable_queue(struct rtcdc_data_channel *channel, size_t capacity, int overflow)
+{
+  if (channel == NULL)
+    return -1;
+
+  if (channel->delivery == NULL) {
+    if (capacity == 0)
+      capacity = RTCDC_DELIVERY_QUEUE_SIZE;
+    channel->delivery = create_delivery_queue(capacity, overflow);
+    if (channel->delivery == NULL)
+      return -1;
+  }
+
+  return channel->delivery->fds[0];
+}
+
+int
+rtcdc_channel_dispatch(struct rtcdc_data_channel *channel, int max)
+{
+  if (channel == NULL || channel->delivery == NULL)
+    return -1;
+
+  int n = 0;
+  struct queued_message m;
+  while ((max <= 0 || n < max) && pop_delivery_queue(channel->delivery, &m) == 0) {
+    if (channel->on_message)
+      channel->on_message(channel, m.type, m.data, m.len, channel->user_data);
+    if (channel->on_message == NULL || channel->recv_mode != RTCDC_RECV_MODE_OWNED)
+      free(m.data);
+    ++n;
+  }
 
-  while (!peer->exit_thread && !dtls->handshake_done)
-    g_usleep(2500);
-  if (peer->exit_thread)
+  return n;
+}
+
+static struct sctp_transport *
+capture_transport(struct rtcdc_peer_connection *peer)
+{
+  if (peer == NULL || peer->transport == NULL)
     return NULL;
+  return peer->transport->sctp;
+}
 
-#ifdef DEBUG_SCTP
-  fprintf(stderr, "DTLS handshake done\n");
-#endif
+// the lock keeps sctp_step off a capture while it is being closed
+static void
+swap_capture(struct sctp_transport *sctp, struct capture *cap)
+{
+  g_mutex_lock(&sctp->capture_mutex);
+  struct capture *old = sctp->capture;
+  g_atomic_pointer_set(&sctp->capture, cap);
+  g_mutex_unlock(&sctp->capture_mutex);
+  close_capture(old);
+}
 
-  if (peer->role == RTCDC_PEER_ROLE_CLIENT) {
-    sctp->stream_cursor = 0; // use even streams
-    struct sockaddr_conn sconn;
-    memset(&sconn, 0, sizeof sconn);
-    sconn.sconn_family = AF_CONN;
-    sconn.sconn_port = htons(sctp->remote_port);
-    sconn.sconn_addr = (void *)sctp;
+int
+rtcdc_start_capture(struct rtcdc_peer_connection *peer, const char *path)
+{
+  struct sctp_transport *sctp = capture_transport(peer);
+  if (sctp == NULL)
+    return -1;
+
+  struct capture *cap = open_capture(path, RTCDC_CAPTURE_BUFFER_SIZE);
+  if (cap == NULL) {
+    log_warning("opening capture file %s failed", path ? path : "(null)");
+    return -1;
+  }
+
+  swap_capture(sctp, cap);
+  return 0;
+}
+
+int
+rtcdc_start_capture_ring(struct rtcdc_peer_connection *peer, size_t bytes)
+{
+  struct sctp_transport *sctp = capture_transport(peer);
+  if (sctp == NULL)
+    return -1;
+
+  struct capture *cap = open_capture_ring(bytes ? bytes : RTCDC_CAPTURE_BUFFER_SIZE);
+  if (cap == NULL)
+    return -1;
+
+  swap_capture(sctp, cap);
+  return 0;
+}
+
+int
+rtcdc_dump_capture(struct rtcdc_peer_connection *peer, const char *path)
+{
+  struct sctp_transport *sctp = capture_transport(peer);
+  if (sctp == NULL)
+    return -1;
+
+  g_mutex_lock(&sctp->capture_mutex);
+  gboolean ring = sctp->capture && sctp->capture->writer == NULL;
+  g_mutex_unlock(&sctp->capture_mutex);
+  if (!ring)
+    return -1;
+
+  // the file is ready before the ring is emptied, a failure loses nothing
+  FILE *file = create_capture_file(path);
+  if (file == NULL)
+    return -1;
+
+  // only the hand-over happens under the lock, sctp_step keeps
+  // filling the ring while the file is written
+  GQueue packets;
+  g_mutex_lock(&sctp->capture_mutex);
+  int r = take_capture_ring(sctp->capture, &packets);
+  g_mutex_unlock(&sctp->capture_mutex);
+  if (r < 0) { // the ring was stopped meanwhile
+    fclose(file);
+    remove(path);
+    return -1;
+  }
+
+  return dump_capture(&packets, file);
+}
+
+void
+rtcdc_stop_capture(struct rtcdc_peer_connection *peer)
+{
+  struct sctp_transport *sctp = capture_transport(peer);
+  if (sctp)
+    swap_capture(sctp, NULL);
+}
+
+#define STARTUP_ICE  0
+#define STARTUP_DTLS 1
+#define STARTUP_SCTP 2
+#define STARTUP_DONE 3
+
+static void
+fill_sctp_address(struct sockaddr_conn *sconn, struct sctp_transport *sctp, int port)
+{
+  memset(sconn, 0, sizeof *sconn);
+  sconn->sconn_family = AF_CONN;
+  sconn->sconn_port = htons(port);
+  sconn->sconn_addr = (void *)sctp;
 #if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__)
-    sconn.sconn_len = sizeof *sctp;
-#endif
-    if (usrsctp_connect(sctp->sock, (struct sockaddr *)&sconn, sizeof sconn) < 0) {
-#ifdef DEBUG_SCTP
-      fprintf(stderr, "SCTP connection failed\n");
-#endif
-    } else {
-#ifdef DEBUG_SCTP
-      fprintf(stderr, "SCTP connected\n");
+  sconn->sconn_len = sizeof *sctp;
 #endif
-      sctp->handshake_done = TRUE;
+}
 
-      if (peer->on_connect)
-        peer->on_connect(peer, peer->user_data);
+// kicks off the association once DTLS is up, returns the next state
+static int
+start_sctp_association(struct rtcdc_peer_connection *peer)
+{
+  struct sctp_transport *sctp = peer->transport->sctp;
+  struct sockaddr_conn sconn;
+
+  if (sctp->one_to_many) {
+    // the association comes up asynchronously on the shared socket,
+    // handshake_done and on_connect are handled by the COMM_UP notification
+    sctp->stream_cursor = peer->role == RTCDC_PEER_ROLE_CLIENT ? 0 : 1;
+    if (peer->role == RTCDC_PEER_ROLE_CLIENT) {
+      fill_sctp_address(&sconn, sctp, sctp->remote_port);
+      if (usrsctp_connect(sctp->sock, (struct sockaddr *)&sconn, sizeof sconn) < 0
+          && errno != EINPROGRESS) {
+        log_warning("SCTP connection failed");
+        close_rtcdc_channels(peer);
+      }
+    }
+    return STARTUP_DONE;
+  }
+
+  if (peer->role == RTCDC_PEER_ROLE_CLIENT) {
+    sctp->stream_cursor = 0; // use even streams
+    fill_sctp_address(&sconn, sctp, sctp->remote_port);
+    // connect without blocking so that teardown can interrupt the wait,
+    // the COMM_UP notification fills in the association id
+    usrsctp_set_non_blocking(sctp->sock, 1);
+    if (usrsctp_connect(sctp->sock, (struct sockaddr *)&sconn, sizeof sconn) < 0
+        && errno != EINPROGRESS) {
+      log_warning("SCTP connection failed");
+      close_rtcdc_channels(peer);
+      return STARTUP_DONE;
     }
   } else {
     sctp->stream_cursor = 1; // use odd streams
-    struct sockaddr_conn sconn;
-    memset(&sconn, 0, sizeof sconn);
-    sconn.sconn_family = AF_CONN;
-    sconn.sconn_port = htons(sctp->local_port);
-    sconn.sconn_addr = (void *)sctp;
-#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__)
-    sconn.sconn_len = sizeof *sctp;
-#endif
     usrsctp_listen(sctp->sock, 1);
+    usrsctp_set_non_blocking(sctp->sock, 1);
+  }
+
+  return STARTUP_SCTP;
+}
+
+// one-to-one only: wait for connect or accept to complete
+static int
+poll_sctp_association(struct rtcdc_peer_connection *peer)
+{
+  struct sctp_transport *sctp = peer->transport->sctp;
+
+  // CANT_STR_ASSOC or COMM_LOST before COMM_UP, nothing left to wait for
+  if (sctp->assoc_failed) {
+    log_warning("SCTP association failed");
+    close_rtcdc_channels(peer);
+    return STARTUP_DONE;
+  }
+
+  if (peer->role == RTCDC_PEER_ROLE_CLIENT) {
+    if (sctp->assoc_id == 0)
+      return STARTUP_SCTP;
+    // stays non-blocking, sctp_step retries sends on EWOULDBLOCK
+    log_info("SCTP connected");
+  } else {
+    struct sockaddr_conn sconn;
     socklen_t len = sizeof sconn;
     struct socket *s = usrsctp_accept(sctp->sock, (struct sockaddr *)&sconn, &len);
-    if (s) {
-#ifdef DEBUG_SCTP
-      fprintf(stderr, "SCTP accepted\n");
-#endif
-      sctp->handshake_done = TRUE;
-      struct socket *t = sctp->sock;
-      sctp->sock = s;
-      usrsctp_close(t);
-
-      if (peer->on_connect)
-        peer->on_connect(peer, peer->user_data);
-    } else {
-#ifdef DEBUG_SCTP
-      fprintf(stderr, "SCTP acception failed\n");
-#endif
+    if (s == NULL && errno == EWOULDBLOCK)
+      return STARTUP_SCTP;
+    if (s == NULL) {
+      log_warning("SCTP acception failed");
+      close_rtcdc_channels(peer);
+      return STARTUP_DONE;
+    }
+    log_info("SCTP accepted");
+    usrsctp_set_non_blocking(s, 1);
+    apply_sctp_scheduler(sctp, s, SCTP_FUTURE_ASSOC);
+    struct socket *t = sctp->sock;
+    sctp->sock = s;
+    usrsctp_close(t);
+  }
+
+  apply_sctp_stream_priorities(peer);
+  sctp->handshake_done = TRUE;
+  if (peer->on_connect)
+    peer->on_connect(peer, peer->user_data);
+
+  return STARTUP_DONE;
+}
+
+// advances ICE -> DTLS -> SCTP without blocking, returns 1 on progress,
+// 0 while waiting and -1 once startup is over
+static int
+startup_step(struct rtcdc_peer_connection *peer)
+{
+  struct rtcdc_transport *transport = peer->transport;
+  struct dtls_transport *dtls = transport->dtls;
+  int client = peer->role == RTCDC_PEER_ROLE_CLIENT;
+  int state = peer->startup_state;
+
+  switch (state) {
+  case STARTUP_ICE:
+    if (!transport->ice->negotiation_done)
+      return 0;
+    log_info("ICE negotiation done");
+    start_dtls_handshake(transport->ctx, dtls, client);
+    state = STARTUP_DTLS;
+    break;
+  case STARTUP_DTLS:
+    if (!dtls->handshake_done && !dtls->handshake_failed)
+      return 0;
+    if (dtls->handshake_failed || finish_dtls_handshake(transport->ctx, dtls, client) < 0) {
+      state = STARTUP_DONE;
+      break;
     }
+    log_info("DTLS handshake done");
+    state = start_sctp_association(peer);
+    break;
+  case STARTUP_SCTP:
+    state = poll_sctp_association(peer);
+    if (state == STARTUP_SCTP)
+      return 0;
+    break;
+  default:
+    return -1;
+  }
+
+  peer->startup_state = state;
+  return 1;
+}
+
+static gpointer
+startup_thread(gpointer user_data)
+{
+  struct rtcdc_peer_connection *peer = (struct rtcdc_peer_connection *)user_data;
+
+  int ret;
+  while (!peer->exit_thread && (ret = startup_step(peer)) >= 0) {
+    if (ret == 0)
+      g_usleep(2500);
   }
 
   return NULL;
@@ -446,14 +1070,27 @@ rtcdc_loop(struct rtcdc_peer_connection *peer)
   if (peer == NULL)
     return;
 
-  while (!peer->initialized)
+  if (peer->ctx->main_context)
+    return;
+
+  while (!peer->initialized && !peer->exit_thread)
     g_usleep(50000);
+  if (!peer->initialized)
+    return;
+
+  struct ice_transport *ice = peer->transport->ice;
+  g_mutex_lock(&ice->loop_mutex);
+  if (peer->exit_thread) {
+    g_mutex_unlock(&ice->loop_mutex);
+    return;
+  }
+  ice->loop_running = TRUE;
+  g_mutex_unlock(&ice->loop_mutex);
 
   GThread *thread_ice = g_thread_new("ICE thread", &ice_thread, peer);
   GThread *thread_sctp = g_thread_new("SCTP thread", &sctp_thread, peer);
   GThread *thread_startup = g_thread_new("Startup thread", &startup_thread, peer);
 
-  struct ice_transport *ice = peer->transport->ice;
   g_main_loop_run(ice->loop);
   peer->exit_thread = TRUE;
 
@@ -464,4 +1101,129 @@ rtcdc_loop(struct rtcdc_peer_connection *peer)
   g_thread_unref(thread_ice);
   g_thread_unref(thread_sctp);
   g_thread_unref(thread_startup);
+
+  g_mutex_lock(&ice->loop_mutex);
+  ice->loop_running = FALSE;
+  g_cond_broadcast(&ice->loop_cond);
+  g_mutex_unlock(&ice->loop_mutex);
+}
+
+int
+rtcdc_use_external_loop(struct rtcdc_context *ctx)
+{
+  if (ctx == NULL)
+    return -1;
+
+  if (ctx->main_context == NULL) {
+    ctx->main_context = g_main_context_new();
+    ctx->watched_fds = g_hash_table_new(g_direct_hash, g_direct_equal);
+    ctx->glib_timeout = -1;
+#ifdef __linux__
+    ctx->event_fd = epoll_create1(EPOLL_CLOEXEC);
+#endif
+  }
+
+  return ctx->event_fd;
+}
+
+#ifdef __linux__
+// mirror the GMainContext poll set into the epoll fd
+static void
+sync_event_fds(struct rtcdc_context *ctx, GPollFD *fds, int nfds)
+{
+  GHashTable *current = g_hash_table_new(g_direct_hash, g_direct_equal);
+  for (int i = 0; i < nfds; ++i) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.events = ((fds[i].events & G_IO_IN) ? EPOLLIN : 0)
+              | ((fds[i].events & G_IO_OUT) ? EPOLLOUT : 0);
+    ev.data.fd = fds[i].fd;
+
+    gpointer key = GINT_TO_POINTER(fds[i].fd);
+    gpointer old;
+    if (!g_hash_table_lookup_extended(ctx->watched_fds, key, NULL, &old))
+      epoll_ctl(ctx->event_fd, EPOLL_CTL_ADD, fds[i].fd, &ev);
+    else if (GPOINTER_TO_UINT(old) != ev.events)
+      epoll_ctl(ctx->event_fd, EPOLL_CTL_MOD, fds[i].fd, &ev);
+    g_hash_table_insert(current, key, GUINT_TO_POINTER(ev.events));
+  }
+
+  GHashTableIter iter;
+  gpointer key;
+  g_hash_table_iter_init(&iter, ctx->watched_fds);
+  while (g_hash_table_iter_next(&iter, &key, NULL)) {
+    if (!g_hash_table_contains(current, key))
+      epoll_ctl(ctx->event_fd, EPOLL_CTL_DEL, GPOINTER_TO_INT(key), NULL);
+  }
+
+  g_hash_table_destroy(ctx->watched_fds);
+  ctx->watched_fds = current;
+}
+#endif
+
+void
+rtcdc_process_events(struct rtcdc_context *ctx)
+{
+  if (ctx == NULL || ctx->main_context == NULL)
+    return;
+
+  run_queued_teardowns(ctx);
+
+  // one non-blocking GLib iteration: libnice I/O, timers and callbacks
+  GMainContext *mc = ctx->main_context;
+  if (!g_main_context_acquire(mc))
+    return;
+
+  gint priority;
+  g_main_context_prepare(mc, &priority);
+
+  GPollFD stack_fds[64];
+  GPollFD *fds = stack_fds;
+  gint timeout;
+  gint nfds = g_main_context_query(mc, priority, &timeout, fds, G_N_ELEMENTS(stack_fds));
+  if (nfds > (gint)G_N_ELEMENTS(stack_fds)) {
+    fds = g_new(GPollFD, nfds);
+    nfds = g_main_context_query(mc, priority, &timeout, fds, nfds);
+  }
+
+  g_poll(fds, nfds, 0);
+  if (g_main_context_check(mc, priority, fds, nfds))
+    g_main_context_dispatch(mc);
+
+#ifdef __linux__
+  if (ctx->event_fd >= 0)
+    sync_event_fds(ctx, fds, nfds);
+#endif
+  if (fds != stack_fds)
+    g_free(fds);
+  g_main_context_release(mc);
+
+  // the work the per-peer threads do in threaded mode
+  int busy = 0;
+  int starting = 0;
+  for (GList *l = ctx->peers; l != NULL; l = l->next) {
+    struct rtcdc_peer_connection *peer = (struct rtcdc_peer_connection *)l->data;
+    if (peer->exit_thread)
+      continue;
+    if (peer->startup_state != STARTUP_DONE) {
+      busy |= startup_step(peer) > 0;
+      starting |= peer->startup_state != STARTUP_DONE;
+    }
+    busy |= ice_step(peer);
+    busy |= sctp_step(peer);
+  }
+
+  ctx->busy = busy;
+  // startup polls for state set by other threads, as the threads did
+  ctx->glib_timeout = starting && (timeout < 0 || timeout > RTCDC_POLL_INTERVAL_MS)
+                      ? RTCDC_POLL_INTERVAL_MS : timeout;
+}
+
+int
+rtcdc_next_timeout(struct rtcdc_context *ctx)
+{
+  if (ctx == NULL || ctx->main_context == NULL)
+    return -1;
+
+  return ctx->busy ? 0 : ctx->glib_timeout;
 }
@@ -6,6 +6,7 @@
 #define _RTCDC_H_
 
 #include <stdint.h>
+#include <sys/types.h>
 
 #ifdef  __cplusplus
 extern "C" {
@@ -23,10 +24,90 @@ extern "C" {
 #define RTCDC_MAX_OUT_STREAM 256
 #endif
 
+// largest message we accept, advertised as a=max-message-size
+#ifndef RTCDC_MAX_MESSAGE_SIZE
+#define RTCDC_MAX_MESSAGE_SIZE (1 << 18)
+#endif
+
+// RFC 8841 default when the remote does not advertise a=max-message-size
+#define RTCDC_DEFAULT_REMOTE_MAX_MESSAGE_SIZE 65536
+
+#ifndef RTCDC_DTLS_SESSION_CACHE_SIZE
+#define RTCDC_DTLS_SESSION_CACHE_SIZE 1024
+#endif
+
+#ifndef RTCDC_ICE_SEND_BATCH
+#define RTCDC_ICE_SEND_BATCH 32
+#endif
+
+// how often rtcdc_process_events wants to run while peers are starting up
+#ifndef RTCDC_POLL_INTERVAL_MS
+#define RTCDC_POLL_INTERVAL_MS 3
+#endif
+
+// bytes buffered per streamed send, memory use does not depend on the message size
+#ifndef RTCDC_STREAM_CHUNK_SIZE
+#define RTCDC_STREAM_CHUNK_SIZE (1 << 14)
+#endif
+
+// default capacity of rtcdc_channel_enable_queue
+#ifndef RTCDC_DELIVERY_QUEUE_SIZE
+#define RTCDC_DELIVERY_QUEUE_SIZE 256
+#endif
+
+// outgoing messages queued per peer, must be a power of two
+#ifndef RTCDC_SEND_RING_SIZE
+#define RTCDC_SEND_RING_SIZE 1024
+#endif
+
+// packet bytes a capture holds: ahead of its file writer, or in its ring
+#ifndef RTCDC_CAPTURE_BUFFER_SIZE
+#define RTCDC_CAPTURE_BUFFER_SIZE (1 << 22)
+#endif
+
+#ifndef RTCDC_MAX_CRYPTO_THREADS
+#define RTCDC_MAX_CRYPTO_THREADS 2
+#endif
+
+#ifndef RTCDC_MAX_TEARDOWN_THREADS
+#define RTCDC_MAX_TEARDOWN_THREADS 4
+#endif
+
+#ifndef RTCDC_RESOLVER_CACHE_TTL
+#define RTCDC_RESOLVER_CACHE_TTL 300 // seconds
+#endif
+
 #define RTCDC_PEER_ROLE_UNKNOWN 0
 #define RTCDC_PEER_ROLE_CLIENT  1
 #define RTCDC_PEER_ROLE_SERVER  2
 
+#define RTCDC_SCTP_MODE_ONE_TO_ONE  0 // one SOCK_STREAM socket per peer
+#define RTCDC_SCTP_MODE_ONE_TO_MANY 1 // one shared SOCK_SEQPACKET socket for all peers
+
+// usrsctp stream scheduler; channel priorities only matter under
+// RTCDC_SCHEDULER_PRIORITY, the others ignore them
+#define RTCDC_SCHEDULER_ROUND_ROBIN    0
+#define RTCDC_SCHEDULER_PRIORITY       1
+#define RTCDC_SCHEDULER_FAIR_BANDWIDTH 2
+
+#define RTCDC_ICE_TRANSPORT_UDP (1 << 0)
+#define RTCDC_ICE_TRANSPORT_TCP (1 << 1) // RFC 6544 ICE-TCP
+#define RTCDC_ICE_TRANSPORT_ALL (RTCDC_ICE_TRANSPORT_UDP | RTCDC_ICE_TRANSPORT_TCP)
+
+#define RTCDC_TURN_UDP 0
+#define RTCDC_TURN_TCP 1
+#define RTCDC_TURN_TLS 2
+
+#define RTCDC_ICE_POLICY_ALL   0 // direct paths first, relays as a fallback
+#define RTCDC_ICE_POLICY_RELAY 1 // relays only, no host or reflexive candidates
+
+#define RTCDC_ICE_STATE_DISCONNECTED 0
+#define RTCDC_ICE_STATE_GATHERING    1
+#define RTCDC_ICE_STATE_CONNECTING   2
+#define RTCDC_ICE_STATE_CONNECTED    3
+#define RTCDC_ICE_STATE_READY        4
+#define RTCDC_ICE_STATE_FAILED       5
+
 #define RTCDC_CHANNEL_STATE_CLOSED     0
 #define RTCDC_CHANNEL_STATE_CONNECTING 1
 #define RTCDC_CHANNEL_STATE_CONNECTED  2
@@ -35,8 +116,32 @@ extern "C" {
 #define RTCDC_DATATYPE_BINARY 1
 #define RTCDC_DATATYPE_EMPTY  2
 
+// BORROWED: data is only valid during on_message
+// OWNED: on_message takes the buffer and hands it to rtcdc_release_message
+#define RTCDC_RECV_MODE_BORROWED 0
+#define RTCDC_RECV_MODE_OWNED    1
+
+// what a full delivery queue does with the next message
+#define RTCDC_OVERFLOW_DROP_NEWEST 0
+#define RTCDC_OVERFLOW_DROP_OLDEST 1
+
+#define RTCDC_LOG_NONE    0
+#define RTCDC_LOG_ERROR   1
+#define RTCDC_LOG_WARNING 2
+#define RTCDC_LOG_INFO    3
+#define RTCDC_LOG_DEBUG   4
+
+struct _GThreadPool;
+struct _GMainContext;
+struct _GHashTable;
+struct _GList;
+struct delivery_queue;
 struct ice_transport;
 struct dtls_context;
+struct sctp_context;
+struct resolver;
+struct resolver_entry;
+struct ice_relay;
 struct dtls_transport;
 struct sctp_transport;
 struct rtcdc_data_channel;
@@ -47,6 +152,8 @@ typedef void (*rtcdc_on_open_cb)(struct rtcdc_data_channel *channel, void *user_
 typedef void (*rtcdc_on_message_cb)(struct rtcdc_data_channel *channel,
                                     int datatype, void *data, size_t len, void *user_data);
 
+// also called when the SCTP association fails to come up or a queued
+// message on the channel cannot be sent
 typedef void (*rtcdc_on_close_cb)(struct rtcdc_data_channel *channel, void *user_data);
 
 typedef void (*rtcdc_on_channel_cb)(struct rtcdc_peer_connection *peer,
@@ -57,6 +164,21 @@ typedef void (*rtcdc_on_candidate_cb)(struct rtcdc_peer_connection *peer,
 
 typedef void (*rtcdc_on_connect_cb)(struct rtcdc_peer_connection *peer, void *user_data);
 
+typedef void (*rtcdc_on_ice_state_cb)(struct rtcdc_peer_connection *peer, int state, void *user_data);
+
+typedef void (*rtcdc_on_destroyed_cb)(void *user_data);
+
+// fills buf with up to len bytes of a streamed message, returns the count
+// or -1 on error
+typedef ssize_t (*rtcdc_read_cb)(void *buf, size_t len, void *user_data);
+
+// status 0 once the last byte is queued in SCTP, -1 if the send failed;
+// a send cut short after its first bytes aborts the SCTP association
+typedef void (*rtcdc_on_sent_cb)(struct rtcdc_data_channel *channel, int status, void *user_data);
+
+// message has no trailing newline; may be called from any library thread
+typedef void (*rtcdc_log_cb)(int level, const char *message, void *user_data);
+
 struct rtcdc_data_channel {
   uint8_t type;
   uint16_t priority;
@@ -66,6 +188,9 @@ struct rtcdc_data_channel {
   char *protocol;
   int state;
   uint16_t sid;
+  int recv_mode; // RTCDC_RECV_MODE_*, see rtcdc_channel_set_recv_mode
+  int delivered; // a message reached on_message or the delivery queue
+  struct delivery_queue *delivery; // NULL: on_message runs in the SCTP upcall
   struct sctp_transport *sctp;
   rtcdc_on_open_cb on_open;
   rtcdc_on_message_cb on_message;
@@ -73,6 +198,30 @@ struct rtcdc_data_channel {
   void *user_data;
 };
 
+struct rtcdc_dtls_stats {
+  unsigned long handshakes;
+  unsigned long resumed; // handshakes that reused a cached session
+  unsigned long cached_sessions;
+};
+
+// shared by the peers created from it, must outlive all of them
+struct rtcdc_context {
+  int ice_transports;     // see rtcdc_set_ice_transports
+  uint16_t ice_min_port;  // see rtcdc_set_ice_port_range
+  uint16_t ice_max_port;
+  struct dtls_context *dtls;
+  struct sctp_context *sctp;
+  struct resolver *resolver;
+  struct _GThreadPool *teardown_pool;
+  struct _GMainContext *main_context; // set by rtcdc_use_external_loop
+  int event_fd;
+  struct _GHashTable *watched_fds;
+  struct _GList *peers; // driven by rtcdc_process_events
+  struct _GList *teardowns; // rtcdc_destroy_peer_connection_async, likewise
+  int glib_timeout;
+  int busy;
+};
+
 struct rtcdc_transport {
   struct dtls_context *ctx;
   struct ice_transport *ice;
@@ -81,27 +230,93 @@ struct rtcdc_transport {
 };
 
 struct rtcdc_peer_connection {
+  struct rtcdc_context *ctx;
   char *stun_server;
   uint16_t stun_port;
+  struct resolver_entry *stun_lookup;
+  struct ice_relay *relays;
+  int ice_policy; // RTCDC_ICE_POLICY_*, see rtcdc_set_ice_policy
   int exit_thread;
   struct rtcdc_transport *transport;
   int initialized;
+  int startup_state;
   int role;
+  int sctp_mode; // RTCDC_SCTP_MODE_*, see rtcdc_set_sctp_mode
+  int sctp_scheduler; // RTCDC_SCHEDULER_*, see rtcdc_set_sctp_scheduler
   struct rtcdc_data_channel *channels[RTCDC_MAX_CHANNEL_NUM];
   rtcdc_on_channel_cb on_channel;
   rtcdc_on_candidate_cb on_candidate;
   rtcdc_on_connect_cb on_connect;
+  rtcdc_on_ice_state_cb on_ice_state; // see rtcdc_set_on_ice_state
   void *user_data;
 };
 
+struct rtcdc_context *
+rtcdc_create_context(void);
+
+void
+rtcdc_destroy_context(struct rtcdc_context *ctx);
+
+void
+rtcdc_get_dtls_stats(struct rtcdc_context *ctx, struct rtcdc_dtls_stats *stats);
+
+// RTCDC_ICE_TRANSPORT_* for host candidates; like the port range it
+// applies to peers whose offer is generated or parsed afterwards
+int
+rtcdc_set_ice_transports(struct rtcdc_context *ctx, int transports);
+
+// restrict host candidates to a fixed range, e.g. the ports opened on a
+// load balancer; 0, 0 removes the restriction
+int
+rtcdc_set_ice_port_range(struct rtcdc_context *ctx, uint16_t min_port, uint16_t max_port);
+
 struct rtcdc_peer_connection *
-rtcdc_create_peer_connection(rtcdc_on_channel_cb, rtcdc_on_candidate_cb, rtcdc_on_connect_cb,
+rtcdc_create_peer_connection(struct rtcdc_context *ctx,
+                             rtcdc_on_channel_cb, rtcdc_on_candidate_cb, rtcdc_on_connect_cb,
                              const char *stun_server, uint16_t stun_port,
                              void *user_data);
 
+// joins the peer's threads, must not be called from one of its callbacks
 void
 rtcdc_destroy_peer_connection(struct rtcdc_peer_connection *peer);
 
+// returns immediately, on_destroyed is called from a context worker thread;
+// with an external loop the teardown and on_destroyed run in the next
+// rtcdc_process_events instead, so it is safe from the peer's callbacks
+void
+rtcdc_destroy_peer_connection_async(struct rtcdc_peer_connection *peer,
+                                    rtcdc_on_destroyed_cb on_destroyed, void *user_data);
+
+// must be called before the offer is generated or parsed
+int
+rtcdc_add_turn_server(struct rtcdc_peer_connection *peer,
+                      const char *server, uint16_t port,
+                      const char *username, const char *password, int type);
+
+// RTCDC_ICE_POLICY_*, must be called before the offer is generated or parsed
+int
+rtcdc_set_ice_policy(struct rtcdc_peer_connection *peer, int policy);
+
+// RTCDC_SCTP_MODE_*, must be called before the offer is generated or parsed
+int
+rtcdc_set_sctp_mode(struct rtcdc_peer_connection *peer, int mode);
+
+// RTCDC_SCHEDULER_*, likewise before the offer is generated or parsed
+int
+rtcdc_set_sctp_scheduler(struct rtcdc_peer_connection *peer, int scheduler);
+
+// RTCDC_ICE_STATE_* changes, likewise before the offer is generated or parsed
+int
+rtcdc_set_on_ice_state(struct rtcdc_peer_connection *peer, rtcdc_on_ice_state_cb on_ice_state);
+
+// DER encoded DTLS session of an established peer, free() the result
+int
+rtcdc_export_dtls_session(struct rtcdc_peer_connection *peer, unsigned char **data, size_t *len);
+
+// resume a previously exported session, call after parsing the remote offer
+int
+rtcdc_import_dtls_session(struct rtcdc_peer_connection *peer, const unsigned char *data, size_t len);
+
 char *
 rtcdc_generate_offer_sdp(struct rtcdc_peer_connection *peer);
 
@@ -111,9 +326,18 @@ rtcdc_generate_local_candidate_sdp(struct rtcdc_peer_connection *peer);
 int
 rtcdc_parse_offer_sdp(struct rtcdc_peer_connection *peer, const char *offer);
 
+// new ICE credentials on the existing transport, DTLS and SCTP are kept;
+// send a fresh rtcdc_generate_offer_sdp() and local candidates afterwards
+int
+rtcdc_restart_ice(struct rtcdc_peer_connection *peer);
+
 int
 rtcdc_parse_candidate_sdp(struct rtcdc_peer_connection *peer, const char *candidates);
 
+// trickle ICE: one remote candidate at a time, "" signals end-of-candidates
+int
+rtcdc_add_remote_candidate(struct rtcdc_peer_connection *peer, const char *candidate);
+
 struct rtcdc_data_channel *
 rtcdc_create_data_channel(struct rtcdc_peer_connection *peer,
                           const char *label, const char *protocol,
@@ -123,12 +347,97 @@ rtcdc_create_data_channel(struct rtcdc_peer_connection *peer,
 void
 rtcdc_destroy_data_channel(struct rtcdc_data_channel *channel);
 
+// copies data into the send queue and returns 0, or -1 when the queue is
+// full or len exceeds the remote a=max-message-size. The message goes out
+// later from the SCTP thread; if that fails the channel is closed and
+// on_close called.
 int
 rtcdc_send_message(struct rtcdc_data_channel *channel, int datatype, void *data, size_t len);
 
+// send one message of len bytes pulled from read in chunks as send buffer
+// space frees up; read and on_sent run on the peer's SCTP thread
+int
+rtcdc_send_stream(struct rtcdc_data_channel *channel, int datatype, size_t len,
+                  rtcdc_read_cb read, rtcdc_on_sent_cb on_sent, void *user_data);
+
+// same, from the current offset of fd to its end; fd is not closed
+int
+rtcdc_send_file(struct rtcdc_data_channel *channel, int datatype, int fd,
+                rtcdc_on_sent_cb on_sent, void *user_data);
+
+// DATA_CHANNEL_PRIORITY_* or anything in between, applied to the channel's
+// outgoing stream when the peer's sctp_scheduler is RTCDC_SCHEDULER_PRIORITY
+// and recorded otherwise
+int
+rtcdc_set_channel_priority(struct rtcdc_data_channel *channel, uint16_t priority);
+
+// RTCDC_RECV_MODE_*, set it from on_open or on_channel; fails once a
+// message has been delivered on the channel
+int
+rtcdc_channel_set_recv_mode(struct rtcdc_data_channel *channel, int mode);
+
+// frees a buffer received in RTCDC_RECV_MODE_OWNED
+void
+rtcdc_release_message(void *data);
+
+// queue received messages instead of calling on_message from the SCTP
+// thread; returns an fd that polls readable while messages are pending.
+// Set it up from on_open or on_channel, before data arrives.
+int
+rtcdc_channel_enable_queue(struct rtcdc_data_channel *channel, size_t capacity, int overflow);
+
+// runs on_message for up to max queued messages (0 for all) on the calling
+// thread, safe from several workers; returns the number delivered
+int
+rtcdc_channel_dispatch(struct rtcdc_data_channel *channel, int max);
+
+// RTCDC_LOG_*, messages above the level cost a single branch;
+// defaults to RTCDC_LOG_WARNING
+void
+rtcdc_set_log_level(int level);
+
+// NULL restores the default handler, which writes to stderr
+void
+rtcdc_set_log_handler(rtcdc_log_cb handler, void *user_data);
+
+// tap the peer's decrypted SCTP packets into a pcap file readable by
+// Wireshark, written from a separate thread; may be toggled while the peer
+// is running. Packets are dropped rather than stall a slow disk.
+int
+rtcdc_start_capture(struct rtcdc_peer_connection *peer, const char *path);
+
+// like rtcdc_start_capture but keeps the newest bytes (0 for
+// RTCDC_CAPTURE_BUFFER_SIZE) in memory until rtcdc_dump_capture
+int
+rtcdc_start_capture_ring(struct rtcdc_peer_connection *peer, size_t bytes);
+
+// writes the ring to a pcap file and empties it, returns the packet count
+int
+rtcdc_dump_capture(struct rtcdc_peer_connection *peer, const char *path);
+
+void
+rtcdc_stop_capture(struct rtcdc_peer_connection *peer);
+
+// runs the peer on its own threads until it is destroyed, not used
+// for peers of a context driven by an external loop
 void
 rtcdc_loop(struct rtcdc_peer_connection *peer);
 
+// switch ctx to be driven from the caller's event loop, before any peer is
+// created; returns an fd that polls readable when rtcdc_process_events has
+// work (-1 without epoll, then rely on rtcdc_next_timeout alone). All calls
+// for the context's peers must then come from that loop's thread.
+int
+rtcdc_use_external_loop(struct rtcdc_context *ctx);
+
+// never blocks: dispatches ICE sources and moves DTLS/SCTP data of all peers
+void
+rtcdc_process_events(struct rtcdc_context *ctx);
+
+// milliseconds until rtcdc_process_events is due without fd activity, -1 for none
+int
+rtcdc_next_timeout(struct rtcdc_context *ctx);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -2,7 +2,11 @@
 // Copyright (c) 2015 Xiaohan Song <chef@dark.kitchen>
 // This file is licensed under a BSD license.
 
+#include <errno.h>
+#include <unistd.h>
 #include "common.h"
+#include "log.h"
+#include "capture.h"
 #include "util.h"
 #include "ice.h"
 #include "dtls.h"
@@ -10,12 +14,354 @@
 #include "dcep.h"
 #include "rtcdc.h"
 
+// usrsctp is a process-wide stack, contexts only share its lifetime
+static GMutex g_sctp_mutex;
 static int g_sctp_ref = 0;
+static gboolean g_sctp_running = FALSE;
 
-static int interested_events[] = {
-  //...
+static uint16_t interested_events[] = {
+  SCTP_ASSOC_CHANGE
 };
 
+static int
+init_send_ring(struct sctp_send_ring *ring, guint size)
+{
+  ring->slots = (struct sctp_send_slot *)calloc(size, sizeof *ring->slots);
+  if (ring->slots == NULL)
+    return -1;
+  for (guint i = 0; i < size; ++i)
+    ring->slots[i].seq = i;
+  ring->mask = size - 1;
+  ring->enqueue_pos = 0;
+  ring->dequeue_pos = 0;
+  return 0;
+}
+
+static int
+send_ring_push(struct sctp_send_ring *ring, const struct sctp_message *msg)
+{
+  guint pos = g_atomic_int_get(&ring->enqueue_pos);
+  struct sctp_send_slot *slot;
+  for (;;) {
+    slot = &ring->slots[pos & ring->mask];
+    gint dif = (gint)((guint)g_atomic_int_get(&slot->seq) - pos);
+    if (dif == 0) {
+      if (g_atomic_int_compare_and_exchange(&ring->enqueue_pos, pos, pos + 1))
+        break;
+      pos = g_atomic_int_get(&ring->enqueue_pos);
+    } else if (dif < 0) {
+      return -1; // full
+    } else {
+      pos = g_atomic_int_get(&ring->enqueue_pos);
+    }
+  }
+  slot->msg = *msg;
+  g_atomic_int_set(&slot->seq, pos + 1);
+  return 0;
+}
+
+static int
+send_ring_pop(struct sctp_send_ring *ring, struct sctp_message *msg)
+{
+  guint pos = ring->dequeue_pos;
+  struct sctp_send_slot *slot = &ring->slots[pos & ring->mask];
+  if ((gint)((guint)g_atomic_int_get(&slot->seq) - (pos + 1)) < 0)
+    return -1; // empty
+  *msg = slot->msg;
+  ring->dequeue_pos = pos + 1;
+  g_atomic_int_set(&slot->seq, pos + ring->mask + 1);
+  return 0;
+}
+
+static gboolean
+send_ring_empty(struct sctp_send_ring *ring)
+{
+  guint pos = ring->dequeue_pos;
+  struct sctp_send_slot *slot = &ring->slots[pos & ring->mask];
+  return (gint)((guint)g_atomic_int_get(&slot->seq) - (pos + 1)) < 0;
+}
+
+static void
+finish_stream_source(struct sctp_transport *sctp, struct sctp_stream_source *src, int status)
+{
+  struct sctp_stream_source **p = &sctp->active_streams;
+  while (*p && *p != src)
+    p = &(*p)->next;
+  if (*p)
+    *p = src->next;
+
+  if (src->on_sent)
+    src->on_sent(src->channel, status, src->user_data);
+  free(src->chunk);
+  free(src);
+}
+
+static void
+append_stream_source(struct sctp_transport *sctp, struct sctp_stream_source *src)
+{
+  struct sctp_stream_source **p = &sctp->active_streams;
+  while (*p)
+    p = &(*p)->next;
+  *p = src;
+}
+
+// only the oldest streamed send of an SCTP stream may write to it
+static gboolean
+stream_source_active(struct sctp_transport *sctp, uint16_t sid,
+                     struct sctp_stream_source *before)
+{
+  for (struct sctp_stream_source *src = sctp->active_streams; src && src != before; src = src->next) {
+    if (src->sid == sid)
+      return TRUE;
+  }
+  return FALSE;
+}
+
+static void
+clear_send_ring(struct sctp_transport *sctp)
+{
+  struct sctp_message m;
+  if (sctp->send_ring.slots == NULL)
+    return;
+  while (send_ring_pop(&sctp->send_ring, &m) == 0) {
+    if (m.source)
+      finish_stream_source(sctp, m.source, -1);
+    free(m.data);
+  }
+  while (sctp->active_streams)
+    finish_stream_source(sctp, sctp->active_streams, -1);
+  GHashTableIter iter;
+  gpointer queue;
+  g_hash_table_iter_init(&iter, sctp->deferred);
+  while (g_hash_table_iter_next(&iter, NULL, &queue)) {
+    struct sctp_message *d;
+    while ((d = g_queue_pop_head((GQueue *)queue))) {
+      if (d->source)
+        finish_stream_source(sctp, d->source, -1);
+      free(d->data);
+      free(d);
+    }
+    g_queue_free((GQueue *)queue);
+    g_hash_table_iter_remove(&iter);
+  }
+  sctp->deferred_count = 0;
+  if (sctp->send_pending) {
+    free(sctp->send_pending->data);
+    free(sctp->send_pending);
+    sctp->send_pending = NULL;
+  }
+  free(sctp->send_ring.slots);
+  sctp->send_ring.slots = NULL;
+}
+
+// a message left without its EOR cannot be withdrawn: a stream reset only
+// goes out once the stream's queue drains, which it then never does. Abort
+// the association so the receiver never takes a truncated message as whole.
+static void
+abort_open_message(struct sctp_transport *sctp, uint16_t sid)
+{
+  log_warning("message on SCTP stream %u cut short, aborting the association", sid);
+  struct sctp_sndinfo info;
+  memset(&info, 0, sizeof info);
+  info.snd_flags = SCTP_ABORT;
+  info.snd_assoc_id = sctp->assoc_id;
+  usrsctp_sendv(sctp->sock, NULL, 0, NULL, 0, &info, sizeof info, SCTP_SENDV_SNDINFO, 0);
+}
+
+// 1 sent or dropped, 0 no buffer space yet. With explicit EOR usrsctp
+// may take only part of the message, the rest follows from m->sent on
+static int
+send_queued_message(struct sctp_transport *sctp, struct sctp_message *m)
+{
+  struct sctp_sndinfo info;
+  memset(&info, 0, sizeof info);
+  info.snd_sid = m->sid;
+  info.snd_flags = SCTP_EOR;
+  info.snd_ppid = htonl(m->ppid);
+  info.snd_assoc_id = sctp->assoc_id;
+  do {
+    ssize_t n = usrsctp_sendv(sctp->sock, (unsigned char *)m->data + m->sent, m->len - m->sent,
+                              NULL, 0, &info, sizeof info, SCTP_SENDV_SNDINFO, 0);
+    if (n < 0) {
+      if (errno == EWOULDBLOCK || errno == EAGAIN)
+        return 0;
+      log_warning("sending SCTP message failed: %s", g_strerror(errno));
+      if (m->sent > 0)
+        abort_open_message(sctp, m->sid);
+      fail_rtcdc_channel((struct rtcdc_peer_connection *)sctp->user_data, m->sid);
+      break;
+    }
+    m->sent += n;
+  } while (m->sent < m->len);
+  return 1;
+}
+
+// 1 complete, 0 no buffer space yet, -1 failed
+static int
+pump_stream_source(struct sctp_transport *sctp, struct sctp_stream_source *src)
+{
+  struct sctp_sndinfo info;
+  memset(&info, 0, sizeof info);
+  info.snd_sid = src->sid;
+  info.snd_ppid = htonl(src->ppid);
+  info.snd_assoc_id = sctp->assoc_id;
+
+  int ret = 1;
+  while (src->sent < src->total) {
+    if (src->chunk_off == src->chunk_len) {
+      size_t want = MIN(RTCDC_STREAM_CHUNK_SIZE, src->total - src->sent);
+      ssize_t n = src->fd >= 0 ? read(src->fd, src->chunk, want)
+                               : src->read(src->chunk, want, src->user_data);
+      if (n <= 0) {
+        ret = -1;
+        break;
+      }
+      src->chunk_len = n;
+      src->chunk_off = 0;
+    }
+
+    size_t left = src->chunk_len - src->chunk_off;
+    info.snd_flags = src->sent + left == src->total ? SCTP_EOR : 0;
+    ssize_t n = usrsctp_sendv(sctp->sock, src->chunk + src->chunk_off, left, NULL, 0,
+                              &info, sizeof info, SCTP_SENDV_SNDINFO, 0);
+    if (n < 0) {
+      if (errno == EWOULDBLOCK || errno == EAGAIN)
+        return 0;
+      ret = -1;
+      break;
+    }
+    src->chunk_off += n;
+    src->sent += n;
+  }
+
+  // a source that fails or runs dry (a file truncated mid-send) must not
+  // end its message early, on_sent reports -1
+  if (ret < 0 && src->sent > 0)
+    abort_open_message(sctp, src->sid);
+  return ret;
+}
+
+static int
+defer_message(struct sctp_transport *sctp, struct sctp_message *m)
+{
+  gpointer key = GINT_TO_POINTER(m->sid);
+  struct sctp_message *d = (struct sctp_message *)malloc(sizeof *m);
+  if (d == NULL)
+    return -1;
+  *d = *m;
+  GQueue *queue = g_hash_table_lookup(sctp->deferred, key);
+  if (queue == NULL) {
+    queue = g_queue_new();
+    g_hash_table_insert(sctp->deferred, key, queue);
+  }
+  g_queue_push_tail(queue, d);
+  sctp->deferred_count++;
+  return 0;
+}
+
+// sends what was held back on streams no longer being streamed to, in
+// queue order per stream; FALSE once the send buffer is full
+static gboolean
+release_deferred(struct sctp_transport *sctp, gboolean *progress)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+  g_hash_table_iter_init(&iter, sctp->deferred);
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    GQueue *queue = (GQueue *)value;
+    struct sctp_message *d;
+    while (!stream_source_active(sctp, GPOINTER_TO_INT(key), NULL)
+           && (d = g_queue_peek_head(queue))) {
+      if (d->source) {
+        append_stream_source(sctp, d->source);
+      } else {
+        size_t sent = d->sent;
+        int done = send_queued_message(sctp, d);
+        if (d->sent != sent)
+          *progress = TRUE;
+        if (!done)
+          return FALSE;
+        free(d->data);
+      }
+      g_queue_pop_head(queue);
+      free(d);
+      sctp->deferred_count--;
+      *progress = TRUE;
+    }
+    if (g_queue_is_empty(queue)) {
+      g_queue_free(queue);
+      g_hash_table_iter_remove(&iter);
+    }
+  }
+  return TRUE;
+}
+
+// runs in sctp_step only, the socket is non-blocking so a full send
+// buffer never stalls input processing; TRUE if anything moved
+static gboolean
+flush_send_ring(struct sctp_transport *sctp)
+{
+  gboolean progress = FALSE;
+  struct sctp_stream_source *src = sctp->active_streams;
+  while (src) {
+    struct sctp_stream_source *next = src->next;
+    if (!stream_source_active(sctp, src->sid, src)) {
+      size_t sent = src->sent;
+      int ret = pump_stream_source(sctp, src);
+      if (ret != 0 || src->sent != sent)
+        progress = TRUE;
+      if (ret != 0)
+        finish_stream_source(sctp, src, ret > 0 ? 0 : -1);
+    }
+    src = next;
+  }
+
+  struct sctp_message m;
+  if (sctp->send_pending) {
+    size_t sent = sctp->send_pending->sent;
+    if (!send_queued_message(sctp, sctp->send_pending))
+      return progress || sctp->send_pending->sent != sent;
+    progress = TRUE;
+    free(sctp->send_pending->data);
+    free(sctp->send_pending);
+    sctp->send_pending = NULL;
+  }
+
+  if (!release_deferred(sctp, &progress))
+    return progress;
+
+  // stop taking from the ring once the held back messages fill a ring's
+  // worth, the producers then see the ring full instead of memory growing
+  while (sctp->deferred_count < RTCDC_SEND_RING_SIZE
+         && send_ring_pop(&sctp->send_ring, &m) == 0) {
+    progress = TRUE;
+    GQueue *queue = g_hash_table_lookup(sctp->deferred, GINT_TO_POINTER(m.sid));
+    if (queue == NULL && m.source) {
+      append_stream_source(sctp, m.source);
+      continue;
+    }
+
+    // a message on a stream being streamed to waits behind it, other
+    // streams keep going
+    if (queue || stream_source_active(sctp, m.sid, NULL)) {
+      if (defer_message(sctp, &m) == 0)
+        continue;
+    } else if (!send_queued_message(sctp, &m)) {
+      sctp->send_pending = (struct sctp_message *)malloc(sizeof m);
+      if (sctp->send_pending) {
+        *sctp->send_pending = m;
+        return progress;
+      }
+    }
+    if (m.source)
+      finish_stream_source(sctp, m.source, -1);
+    else
+      fail_rtcdc_channel((struct rtcdc_peer_connection *)sctp->user_data, m.sid);
+    free(m.data);
+  }
+  return progress;
+}
+
 static int
 sctp_data_ready_cb(void *reg_addr, void *data, size_t len, uint8_t tos, uint8_t set_df)
 {
@@ -23,144 +369,444 @@ sctp_data_ready_cb(void *reg_addr, void *data, size_t len, uint8_t tos, uint8_t
   g_mutex_lock(&sctp->sctp_mutex);
   BIO_write(sctp->outgoing_bio, data, len);
   g_mutex_unlock(&sctp->sctp_mutex);
+  if (sctp->wakeup) // also emitted from usrsctp's timer thread
+    g_main_context_wakeup(sctp->wakeup);
   return 0;
 }
 
+void
+apply_sctp_scheduler(struct sctp_transport *sctp, struct socket *s, sctp_assoc_t assoc_id)
+{
+  struct sctp_assoc_value av;
+  av.assoc_id = assoc_id;
+  if (sctp->scheduler == RTCDC_SCHEDULER_PRIORITY)
+    av.assoc_value = SCTP_SS_PRIORITY;
+  else if (sctp->scheduler == RTCDC_SCHEDULER_FAIR_BANDWIDTH)
+    av.assoc_value = SCTP_SS_FAIR_BANDWITH;
+  else
+    av.assoc_value = SCTP_SS_ROUND_ROBIN;
+  if (usrsctp_setsockopt(s, IPPROTO_SCTP, SCTP_PLUGGABLE_SS, &av, sizeof av) < 0)
+    log_warning("setting SCTP stream scheduler failed");
+}
+
+// the priority scheduler sends the lowest value first, DCEP uses higher
+// numbers for more important channels; round robin and fair bandwidth
+// have no per-stream value (usrsctp rejects SCTP_SS_VALUE for them)
+int
+set_sctp_stream_priority(struct sctp_transport *sctp, uint16_t sid, uint16_t priority)
+{
+  if (sctp == NULL || sctp->sock == NULL || sctp->scheduler != RTCDC_SCHEDULER_PRIORITY)
+    return 0;
+
+  struct sctp_stream_value sv;
+  sv.assoc_id = sctp->assoc_id;
+  sv.stream_id = sid;
+  sv.stream_value = UINT16_MAX - priority;
+  return usrsctp_setsockopt(sctp->sock, IPPROTO_SCTP, SCTP_SS_VALUE, &sv, sizeof sv) < 0 ? -1 : 0;
+}
+
+// stream values only stick to an existing association, channels created
+// before it was up get theirs again here
+void
+apply_sctp_stream_priorities(struct rtcdc_peer_connection *peer)
+{
+  struct sctp_transport *sctp = peer->transport->sctp;
+  for (int i = 0; i < RTCDC_MAX_CHANNEL_NUM; ++i) {
+    struct rtcdc_data_channel *ch = peer->channels[i];
+    if (ch && ch->sctp == sctp && set_sctp_stream_priority(sctp, ch->sid, ch->priority) < 0)
+      log_warning("setting priority of SCTP stream %u failed", ch->sid);
+  }
+}
+
+static void
+handle_association_change_event(struct rtcdc_peer_connection *peer, struct sctp_assoc_change *sac)
+{
+  struct sctp_transport *sctp = peer->transport->sctp;
+
+  switch (sac->sac_state) {
+    case SCTP_COMM_UP:
+      sctp->assoc_id = sac->sac_assoc_id;
+      // one-to-one sockets get both once connect/accept completes
+      if (sctp->one_to_many) {
+        apply_sctp_scheduler(sctp, sctp->sock, sctp->assoc_id);
+        apply_sctp_stream_priorities(peer);
+      }
+      // one-to-one sockets are done in connect/accept, shared ones only learn it here
+      if (sctp->one_to_many && !sctp->handshake_done) {
+        log_info("SCTP association %u up", sac->sac_assoc_id);
+        sctp->handshake_done = TRUE;
+        if (peer->on_connect)
+          peer->on_connect(peer, peer->user_data);
+      }
+      break;
+    case SCTP_COMM_LOST:
+    case SCTP_SHUTDOWN_COMP:
+    case SCTP_CANT_STR_ASSOC:
+      log_info("SCTP association %u down", sac->sac_assoc_id);
+      // one-to-one startup polls for the flag, a shared socket's startup
+      // is already over and reports it here
+      if (!sctp->handshake_done) {
+        sctp->assoc_failed = TRUE;
+        if (sctp->one_to_many)
+          close_rtcdc_channels(peer);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
 static void
 handle_notification_message(struct rtcdc_peer_connection *peer, union sctp_notification *notify, size_t len)
 {
-  //...
+  if (notify->sn_header.sn_length != len)
+    return;
+
+  switch (notify->sn_header.sn_type) {
+    case SCTP_ASSOC_CHANGE:
+      handle_association_change_event(peer, &notify->sn_assoc_change);
+      break;
+    default:
+      break;
+  }
+}
+
+static void
+free_partial_message(gpointer data)
+{
+  struct sctp_partial_message *pm = (struct sctp_partial_message *)data;
+  free(pm->data);
+  free(pm);
+}
+
+// takes data, returns the whole message once eor is set and NULL before
+static void *
+join_partial_message(struct sctp_transport *sctp, uint16_t sid, void *data, size_t *len, int eor)
+{
+  gpointer key = GUINT_TO_POINTER(sid);
+  struct sctp_partial_message *pm = g_hash_table_lookup(sctp->partial_messages, key);
+  if (pm == NULL) {
+    if (eor)
+      return data;
+    pm = (struct sctp_partial_message *)calloc(1, sizeof *pm);
+    if (pm == NULL) {
+      free(data);
+      return NULL;
+    }
+    g_hash_table_insert(sctp->partial_messages, key, pm);
+  }
+
+  // we advertised a=max-message-size, anything bigger is dropped whole:
+  // the entry stays and swallows the remaining pieces up to MSG_EOR
+  unsigned char *joined = NULL;
+  if (!pm->discard) {
+    joined = pm->len + *len <= RTCDC_MAX_MESSAGE_SIZE
+      ? (unsigned char *)realloc(pm->data, pm->len + *len) : NULL;
+    if (joined == NULL) {
+      log_warning("dropping oversized SCTP message on stream %u", sid);
+      free(pm->data);
+      pm->data = NULL;
+      pm->len = 0;
+      pm->discard = TRUE;
+    }
+  }
+  if (pm->discard) {
+    free(data);
+    if (eor)
+      g_hash_table_remove(sctp->partial_messages, key);
+    return NULL;
+  }
+  memcpy(joined + pm->len, data, *len);
+  pm->data = joined;
+  pm->len += *len;
+  free(data);
+
+  if (!eor)
+    return NULL;
+
+  void *message = pm->data;
+  *len = pm->len;
+  pm->data = NULL;
+  g_hash_table_remove(sctp->partial_messages, key);
+  return message;
 }
 
 static int
 sctp_data_received_cb(struct socket *sock, union sctp_sockstore addr, void *data,
                       size_t len, struct sctp_rcvinfo recv_info, int flags, void *peer_data)
 {
-  if (peer_data == NULL || len == 0)
+  struct rtcdc_peer_connection *peer = (struct rtcdc_peer_connection *)peer_data;
+  if (peer == NULL && addr.sconn.sconn_addr != NULL) // shared one-to-many socket
+    peer = (struct rtcdc_peer_connection *)((struct sctp_transport *)addr.sconn.sconn_addr)->user_data;
+  if (peer == NULL || peer->transport == NULL || len == 0) {
+    free(data);
     return -1;
+  }
 
-  struct rtcdc_peer_connection *peer = (struct rtcdc_peer_connection *)peer_data;
   struct rtcdc_transport *transport = peer->transport;
   struct sctp_transport *sctp = transport->sctp;
 
-#ifdef DEBUG_SCTP
-  printf("data of length %zu received on stream %u with SSN %u, TSN %u, PPID %u\n",
-         len,
-         recv_info.rcv_sid,
-         recv_info.rcv_ssn,
-         recv_info.rcv_tsn,
-         ntohl(recv_info.rcv_ppid));
-#endif
+  log_debug("data of length %zu received on stream %u with SSN %u, TSN %u, PPID %u",
+            len,
+            recv_info.rcv_sid,
+            recv_info.rcv_ssn,
+            recv_info.rcv_tsn,
+            ntohl(recv_info.rcv_ppid));
+
+  // pieces of one message arrive without MSG_EOR, possibly interleaved
+  // with other streams, and are joined per stream before delivery
+  if (!(flags & MSG_NOTIFICATION)
+      && (!(flags & MSG_EOR) || g_hash_table_size(sctp->partial_messages) > 0)) {
+    data = join_partial_message(sctp, recv_info.rcv_sid, data, &len, flags & MSG_EOR);
+    if (data == NULL)
+      return 0;
+  }
 
+  // usrsctp hands over a malloc'd buffer, OWNED channels keep it
   if (flags & MSG_NOTIFICATION)
     handle_notification_message(peer, (union sctp_notification *)data, len);
-  else
-    handle_rtcdc_message(peer, data, len, ntohl(recv_info.rcv_ppid), recv_info.rcv_sid);
+  else if (handle_rtcdc_message(peer, data, len, ntohl(recv_info.rcv_ppid), recv_info.rcv_sid))
+    return 0;
 
   free(data);
   return 0;
 }
 
+static void
+configure_sctp_socket(struct socket *s)
+{
+  struct sctp_paddrparams peer_param;
+  memset(&peer_param, 0, sizeof peer_param);
+  peer_param.spp_flags = SPP_PMTUD_DISABLE;
+  peer_param.spp_pathmtu = 1200;
+  usrsctp_setsockopt(s, IPPROTO_SCTP, SCTP_PEER_ADDR_PARAMS, &peer_param, sizeof peer_param);
+
+  struct sctp_assoc_value av;
+  av.assoc_id = SCTP_ALL_ASSOC;
+  av.assoc_value = 1;
+  usrsctp_setsockopt(s, IPPROTO_SCTP, SCTP_ENABLE_STREAM_RESET, &av, sizeof av);
+
+  uint32_t nodelay = 1;
+  usrsctp_setsockopt(s, IPPROTO_SCTP, SCTP_NODELAY, &nodelay, sizeof nodelay);
+
+  // messages may be written piecewise, ordinary sends always carry SCTP_EOR
+  uint32_t eor = 1;
+  usrsctp_setsockopt(s, IPPROTO_SCTP, SCTP_EXPLICIT_EOR, &eor, sizeof eor);
+
+  // room for at least one message of the advertised a=max-message-size
+  int rcvbuf = RTCDC_MAX_MESSAGE_SIZE;
+  usrsctp_setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+
+  struct sctp_initmsg init_msg;
+  memset(&init_msg, 0, sizeof init_msg);
+  init_msg.sinit_num_ostreams = RTCDC_MAX_OUT_STREAM;
+  init_msg.sinit_max_instreams = RTCDC_MAX_IN_STREAM;
+  usrsctp_setsockopt(s, IPPROTO_SCTP, SCTP_INITMSG, &init_msg, sizeof init_msg);
+
+  // I-DATA (RFC 8260) so a large message does not hold back other streams;
+  // needs fragment interleave level 2, peers without it get plain DATA
+  int level = SCTP_FRAG_LEVEL_2;
+  usrsctp_setsockopt(s, IPPROTO_SCTP, SCTP_FRAGMENT_INTERLEAVE, &level, sizeof level);
+  av.assoc_id = SCTP_FUTURE_ASSOC;
+  av.assoc_value = 1;
+  if (usrsctp_setsockopt(s, IPPROTO_SCTP, SCTP_INTERLEAVING_SUPPORTED, &av, sizeof av) < 0)
+    log_info("SCTP message interleaving unavailable");
+
+  struct sctp_event event;
+  memset(&event, 0, sizeof event);
+  event.se_assoc_id = SCTP_ALL_ASSOC;
+  event.se_on = 1;
+  for (int i = 0; i < sizeof interested_events / sizeof interested_events[0]; ++i) {
+    event.se_type = interested_events[i];
+    usrsctp_setsockopt(s, IPPROTO_SCTP, SCTP_EVENT, &event, sizeof event);
+  }
+}
+
+// one-to-many socket shared by all peers of a context in RTCDC_SCTP_MODE_ONE_TO_MANY,
+// associations are told apart by the registered address (the transport)
+static struct socket *
+acquire_shared_sctp_socket(struct sctp_context *context)
+{
+  g_mutex_lock(&context->shared_mutex);
+  if (context->shared_sock == NULL) {
+    struct socket *s = usrsctp_socket(AF_CONN, SOCK_SEQPACKET, IPPROTO_SCTP,
+                                      sctp_data_received_cb, NULL, 0, NULL);
+    if (s == NULL)
+      goto shared_err;
+    configure_sctp_socket(s);
+    usrsctp_set_non_blocking(s, 1);
+
+    int port = random_integer(10000, 60000);
+    struct sockaddr_conn sconn;
+    memset(&sconn, 0, sizeof sconn);
+    sconn.sconn_family = AF_CONN;
+    sconn.sconn_port = htons(port);
+    sconn.sconn_addr = NULL; // wildcard, accept on every registered address
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+    sconn.sconn_len = sizeof sconn;
+#endif
+    if (usrsctp_bind(s, (struct sockaddr *)&sconn, sizeof sconn) < 0
+        || usrsctp_listen(s, 1) < 0) {
+      usrsctp_close(s);
+      goto shared_err;
+    }
+    context->shared_sock = s;
+    context->shared_port = port;
+  }
+  context->shared_ref++;
+  g_mutex_unlock(&context->shared_mutex);
+
+  return context->shared_sock;
+
+shared_err:
+  g_mutex_unlock(&context->shared_mutex);
+  return NULL;
+}
+
+static void
+release_shared_sctp_socket(struct sctp_context *context)
+{
+  g_mutex_lock(&context->shared_mutex);
+  if (--context->shared_ref <= 0) {
+    usrsctp_close(context->shared_sock);
+    context->shared_sock = NULL;
+    context->shared_port = 0;
+    context->shared_ref = 0;
+  }
+  g_mutex_unlock(&context->shared_mutex);
+}
+
+struct sctp_context *
+create_sctp_context(void)
+{
+  struct sctp_context *context = (struct sctp_context *)calloc(1, sizeof *context);
+  if (context == NULL)
+    return NULL;
+  g_mutex_init(&context->shared_mutex);
+
+  g_mutex_lock(&g_sctp_mutex);
+  if (!g_sctp_running) {
+    usrsctp_init(0, sctp_data_ready_cb, NULL);
+    usrsctp_sysctl_set_sctp_ecn_enable(0);
+    g_sctp_running = TRUE;
+  }
+  g_sctp_ref++;
+  g_mutex_unlock(&g_sctp_mutex);
+
+  return context;
+}
+
+void
+destroy_sctp_context(struct sctp_context *context)
+{
+  if (context == NULL)
+    return;
+
+  if (context->shared_sock)
+    usrsctp_close(context->shared_sock);
+  g_mutex_clear(&context->shared_mutex);
+  free(context);
+  context = NULL;
+
+  // a single attempt: if associations are still draining usrsctp stays
+  // up and is reused by the next context instead of blocking here
+  g_mutex_lock(&g_sctp_mutex);
+  if (--g_sctp_ref <= 0) {
+    g_sctp_ref = 0;
+    if (usrsctp_finish() == 0)
+      g_sctp_running = FALSE;
+  }
+  g_mutex_unlock(&g_sctp_mutex);
+}
+
 struct sctp_transport *
 create_sctp_transport(struct rtcdc_peer_connection *peer)
 {
-  if (peer == NULL || peer->transport == NULL)
+  if (peer == NULL || peer->transport == NULL || peer->ctx == NULL)
     return NULL;
 
   struct sctp_transport *sctp = (struct sctp_transport *)calloc(1, sizeof *sctp);
   if (sctp == NULL)
     return NULL;
   peer->transport->sctp = sctp;
-  sctp->local_port = random_integer(10000, 60000);
-
-  if (g_sctp_ref == 0) {
-    usrsctp_init(0, sctp_data_ready_cb, NULL);
-    usrsctp_sysctl_set_sctp_ecn_enable(0);
-  }
-  g_sctp_ref++;
+  sctp->user_data = peer;
+  sctp->context = peer->ctx->sctp;
+  sctp->remote_max_message_size = RTCDC_DEFAULT_REMOTE_MAX_MESSAGE_SIZE;
+  sctp->one_to_many = peer->sctp_mode == RTCDC_SCTP_MODE_ONE_TO_MANY;
+  sctp->scheduler = peer->sctp_scheduler;
+  g_mutex_init(&sctp->capture_mutex);
 
   usrsctp_register_address(sctp);
-  struct socket *s = usrsctp_socket(AF_CONN, SOCK_STREAM, IPPROTO_SCTP,
-                                    sctp_data_received_cb, NULL, 0, peer);
-  if (s == NULL)
-    goto trans_err;
+  struct socket *s;
+  if (sctp->one_to_many) {
+    s = acquire_shared_sctp_socket(sctp->context);
+    if (s == NULL)
+      goto trans_err;
+    sctp->local_port = sctp->context->shared_port;
+  } else {
+    s = usrsctp_socket(AF_CONN, SOCK_STREAM, IPPROTO_SCTP,
+                       sctp_data_received_cb, NULL, 0, peer);
+    if (s == NULL)
+      goto trans_err;
+    sctp->local_port = random_integer(10000, 60000);
+  }
   sctp->sock = s;
 
-  BIO *bio = BIO_new(BIO_s_mem());
+  // one SCTP packet per entry, packets must not be coalesced
+  BIO *bio = BIO_new(dgram_queue_method());
   if (bio == NULL)
     goto trans_err;
-  BIO_set_mem_eof_return(bio, -1);
   sctp->incoming_bio = bio;
 
-  bio = BIO_new(BIO_s_mem());
+  bio = BIO_new(dgram_queue_method());
   if (bio == NULL)
     goto trans_err;
-  BIO_set_mem_eof_return(bio, -1);
   sctp->outgoing_bio = bio;
 
-#ifdef DEBUG_SCTP
-  int sd;
-  struct sockaddr_in stub_addr;
-  memset(&stub_addr, 0, sizeof stub_addr);
-  inet_pton(AF_INET, "127.0.0.1", &stub_addr.sin_addr);
-  stub_addr.sin_family = AF_INET;
-
-  sd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-  stub_addr.sin_port = htons(60001);
-  bind(sd, (const struct sockaddr *)&stub_addr, sizeof stub_addr);
-  stub_addr.sin_port = htons(60002);
-  connect(sd, (const struct sockaddr *)&stub_addr, sizeof stub_addr);
-  sctp->incoming_stub = sd;
-
-  sd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-  stub_addr.sin_port = htons(60002);
-  bind(sd, (const struct sockaddr *)&stub_addr, sizeof stub_addr);
-  stub_addr.sin_port = htons(60001);
-  connect(sd, (const struct sockaddr *)&stub_addr, sizeof stub_addr);
-  sctp->outgoing_stub = sd;
-#endif
-
-  struct linger lopt;
-  lopt.l_onoff = 1;
-  lopt.l_linger = 0;
-  usrsctp_setsockopt(s, SOL_SOCKET, SO_LINGER, &lopt, sizeof lopt);
-
-  struct sctp_paddrparams peer_param;
-  memset(&peer_param, 0, sizeof peer_param);
-  peer_param.spp_flags = SPP_PMTUD_DISABLE;
-  peer_param.spp_pathmtu = 1200;
-  usrsctp_setsockopt(s, IPPROTO_SCTP, SCTP_PEER_ADDR_PARAMS, &peer_param, sizeof peer_param);
-
-  struct sctp_assoc_value av;
-  av.assoc_id = SCTP_ALL_ASSOC;
-  av.assoc_value = 1;
-  usrsctp_setsockopt(s, IPPROTO_SCTP, SCTP_ENABLE_STREAM_RESET, &av, sizeof av);
-
-  uint32_t nodelay = 1;
-  usrsctp_setsockopt(s, IPPROTO_SCTP, SCTP_NODELAY, &nodelay, sizeof nodelay);
+  if (!sctp->one_to_many) {
+    struct linger lopt;
+    lopt.l_onoff = 1;
+    lopt.l_linger = 0;
+    usrsctp_setsockopt(s, SOL_SOCKET, SO_LINGER, &lopt, sizeof lopt);
 
-  struct sctp_initmsg init_msg;
-  memset(&init_msg, 0, sizeof init_msg);
-  init_msg.sinit_num_ostreams = RTCDC_MAX_OUT_STREAM;
-  init_msg.sinit_max_instreams = RTCDC_MAX_IN_STREAM;
-  usrsctp_setsockopt(s, IPPROTO_SCTP, SCTP_INITMSG, &init_msg, sizeof init_msg);
+    configure_sctp_socket(s);
+    apply_sctp_scheduler(sctp, s, SCTP_FUTURE_ASSOC);
 
-  struct sockaddr_conn sconn;
-  memset(&sconn, 0, sizeof sconn);
-  sconn.sconn_family = AF_CONN;
-  sconn.sconn_port = htons(sctp->local_port);
-  sconn.sconn_addr = (void *)sctp;
+    struct sockaddr_conn sconn;
+    memset(&sconn, 0, sizeof sconn);
+    sconn.sconn_family = AF_CONN;
+    sconn.sconn_port = htons(sctp->local_port);
+    sconn.sconn_addr = (void *)sctp;
 #if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__)
-  sconn.sconn_len = sizeof *sctp;
+    sconn.sconn_len = sizeof *sctp;
 #endif
-  usrsctp_bind(s, (struct sockaddr *)&sconn, sizeof sconn);
+    usrsctp_bind(s, (struct sockaddr *)&sconn, sizeof sconn);
+  }
 
-  sctp->deferred_messages = g_async_queue_new();
+  sctp->deferred = g_hash_table_new(g_direct_hash, g_direct_equal);
+  if (init_send_ring(&sctp->send_ring, RTCDC_SEND_RING_SIZE) < 0)
+    goto trans_err;
+  sctp->partial_messages = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                                 NULL, free_partial_message);
 
   if (0) {
 trans_err:
     peer->transport->sctp = NULL;
-    usrsctp_finish();
+    if (sctp->sock) {
+      if (sctp->one_to_many)
+        release_shared_sctp_socket(sctp->context);
+      else
+        usrsctp_close(sctp->sock);
+    }
+    BIO_free_all(sctp->incoming_bio);
+    BIO_free_all(sctp->outgoing_bio);
+    usrsctp_deregister_address(sctp);
+    clear_send_ring(sctp);
+    if (sctp->deferred)
+      g_hash_table_destroy(sctp->deferred);
+    if (sctp->partial_messages)
+      g_hash_table_destroy(sctp->partial_messages);
+    g_mutex_clear(&sctp->capture_mutex);
     free(sctp);
     sctp = NULL;
   }
@@ -168,137 +814,175 @@ trans_err:
   return sctp;
 }
 
+void
+abort_sctp_transport(struct sctp_transport *sctp)
+{
+  if (sctp == NULL || sctp->sock == NULL)
+    return;
+
+  // the ABORT is emitted synchronously through sctp_data_ready_cb
+  if (sctp->one_to_many) {
+    // only tear down our own association, the socket is shared
+    if (sctp->assoc_id) {
+      struct sctp_sndinfo info;
+      memset(&info, 0, sizeof info);
+      info.snd_flags = SCTP_ABORT;
+      info.snd_assoc_id = sctp->assoc_id;
+      usrsctp_sendv(sctp->sock, NULL, 0, NULL, 0,
+                    &info, sizeof info, SCTP_SENDV_SNDINFO, 0);
+    }
+    release_shared_sctp_socket(sctp->context);
+  } else {
+    usrsctp_close(sctp->sock); // SO_LINGER 0, sends an ABORT
+  }
+  sctp->sock = NULL;
+}
+
 void
 destroy_sctp_transport(struct sctp_transport *sctp)
 {
   if (sctp == NULL)
     return;
 
-  usrsctp_close(sctp->sock);
+  abort_sctp_transport(sctp);
   usrsctp_deregister_address(sctp);
   BIO_free_all(sctp->incoming_bio);
   BIO_free_all(sctp->outgoing_bio);
-#ifdef DEBUG_SCTP
-  close(sctp->incoming_stub);
-  close(sctp->outgoing_stub);
-#endif
-  g_async_queue_unref(sctp->deferred_messages);
+  close_capture(sctp->capture);
+  clear_send_ring(sctp);
+  g_hash_table_destroy(sctp->deferred);
+  g_hash_table_destroy(sctp->partial_messages);
+  g_mutex_clear(&sctp->capture_mutex);
   free(sctp);
   sctp = NULL;
-
-  g_sctp_ref--;
-  if (g_sctp_ref == 0) {
-    for (int i = 0; i < 300; ++i) {
-      if (usrsctp_finish() == 0)
-        return;
-      g_usleep(10000);
-    }
-  }
 }
 
-gpointer
-sctp_thread(gpointer user_data)
+// one pass between usrsctp, the send ring and DTLS, returns 1 if busy
+int
+sctp_step(struct rtcdc_peer_connection *peer)
 {
-  struct rtcdc_peer_connection *peer = (struct rtcdc_peer_connection *)user_data;
   struct rtcdc_transport *transport = peer->transport;
   struct ice_transport *ice = transport->ice;
   struct dtls_transport *dtls = transport->dtls;
   struct sctp_transport *sctp = transport->sctp;
+  if (!ice->negotiation_done || !dtls->handshake_done)
+    return 0;
 
-  while (!peer->exit_thread && !ice->negotiation_done)
-    g_usleep(2500);
-  if (peer->exit_thread)
-    return NULL;
+  gboolean progress = sctp->handshake_done && flush_send_ring(sctp);
 
-  while (!peer->exit_thread && !dtls->handshake_done)
-    g_usleep(2500);
-  if (peer->exit_thread)
-    return NULL;
+  // one lock round per batch of packets instead of per packet
+  struct dgram *in[RTCDC_ICE_SEND_BATCH];
+  g_mutex_lock(&sctp->sctp_mutex);
+  guint n = dgram_queue_pop(sctp->incoming_bio, in, RTCDC_ICE_SEND_BATCH);
+  g_mutex_unlock(&sctp->sctp_mutex);
+  for (guint i = 0; i < n; ++i)
+    usrsctp_conninput(sctp, in[i]->data, in[i]->len, 0);
 
-  char buf[BUFFER_SIZE];
-  while (!peer->exit_thread) {
-    if (BIO_ctrl_pending(sctp->incoming_bio) <= 0 && BIO_ctrl_pending(sctp->outgoing_bio) <= 0)
-      g_usleep(2500);
+  struct dgram *out[RTCDC_ICE_SEND_BATCH];
+  g_mutex_lock(&sctp->sctp_mutex);
+  guint m = dgram_queue_pop(sctp->outgoing_bio, out, RTCDC_ICE_SEND_BATCH);
+  g_mutex_unlock(&sctp->sctp_mutex);
+  if (m > 0) {
+    g_mutex_lock(&dtls->dtls_mutex);
+    for (guint i = 0; i < m; ++i)
+      SSL_write(dtls->ssl, out[i]->data, out[i]->len);
+    g_mutex_unlock(&dtls->dtls_mutex);
+  }
 
-    if (BIO_ctrl_pending(sctp->incoming_bio) > 0) {
-      g_mutex_lock(&sctp->sctp_mutex);
-      int nbytes = BIO_read(sctp->incoming_bio, buf, sizeof buf);
-      g_mutex_unlock(&sctp->sctp_mutex);
-#ifdef DEBUG_SCTP
-      send(sctp->incoming_stub, buf, nbytes, 0);
-#endif
-      if (nbytes > 0) {
-        usrsctp_conninput(sctp, buf, nbytes, 0);
-      }
+  // the tap costs one atomic load unless rtcdc_start_capture installed one,
+  // and only copies packets when it did
+  if ((n > 0 || m > 0) && g_atomic_pointer_get(&sctp->capture) != NULL) {
+    g_mutex_lock(&sctp->capture_mutex);
+    if (sctp->capture) {
+      for (guint i = 0; i < n; ++i)
+        push_capture_packet(sctp->capture, 0, in[i]->data, in[i]->len);
+      for (guint i = 0; i < m; ++i)
+        push_capture_packet(sctp->capture, 1, out[i]->data, out[i]->len);
     }
+    g_mutex_unlock(&sctp->capture_mutex);
+  }
 
-    if (BIO_ctrl_pending(sctp->outgoing_bio) > 0) {
-      g_mutex_lock(&sctp->sctp_mutex);
-      int nbytes = BIO_read(sctp->outgoing_bio, buf, sizeof buf);
-      g_mutex_unlock(&sctp->sctp_mutex);
-#ifdef DEBUG_SCTP
-      send(sctp->outgoing_stub, buf, nbytes, 0);
-#endif
-      if (nbytes > 0) {
-        g_mutex_lock(&dtls->dtls_mutex);
-        SSL_write(dtls->ssl, buf, nbytes);
-        g_mutex_unlock(&dtls->dtls_mutex);
-      }
-    }
+  for (guint i = 0; i < n; ++i)
+    free(in[i]);
+  for (guint i = 0; i < m; ++i)
+    free(out[i]);
+
+  // a message or streamed send blocked on send space is not work: polling
+  // for it would spin, incoming SACKs wake the loop once space frees up
+  return n > 0 || m > 0 || progress
+    || (sctp->handshake_done && sctp->send_pending == NULL
+        && sctp->deferred_count < RTCDC_SEND_RING_SIZE && !send_ring_empty(&sctp->send_ring));
+}
+
+gpointer
+sctp_thread(gpointer user_data)
+{
+  struct rtcdc_peer_connection *peer = (struct rtcdc_peer_connection *)user_data;
+
+  while (!peer->exit_thread) {
+    if (!sctp_step(peer))
+      g_usleep(2500);
   }
 
   return NULL;
 }
 
+// callable from any thread, the payload is copied and sent by sctp_step;
+// fails when the ring is full
 int
 send_sctp_message(struct sctp_transport *sctp,
                   void *data, size_t len, uint16_t sid, uint32_t ppid)
 {
-  if (sctp == NULL || sctp->deferred_messages == NULL)
+  if (sctp == NULL || sctp->send_ring.slots == NULL)
     return -1;
 
-  if (sctp->handshake_done) {
-    struct sctp_message *m;
-    while ((m = (struct sctp_message *)g_async_queue_try_pop(sctp->deferred_messages))) {
-      struct sctp_sndinfo info;
-      memset(&info, 0, sizeof info);
-      info.snd_sid = m->sid;
-      info.snd_flags = SCTP_EOR;
-      info.snd_ppid = htonl(m->ppid);
-      if (usrsctp_sendv(sctp->sock, m->data, m->len, NULL, 0,
-                        &info, sizeof info, SCTP_SENDV_SNDINFO, 0) < 0) {
-#ifdef DEBUG_SCTP
-        fprintf(stderr, "sending deferred SCTP message failed\n");
-#endif
-      }
-      free(m);
-    }
-
-    struct sctp_sndinfo info;
-    memset(&info, 0, sizeof info);
-    info.snd_sid = sid;
-    info.snd_flags = SCTP_EOR;
-    info.snd_ppid = htonl(ppid);
-    if (usrsctp_sendv(sctp->sock, data, len, NULL, 0,
-                      &info, sizeof info, SCTP_SENDV_SNDINFO, 0) < 0) {
-#ifdef DEBUG_SCTP
-      fprintf(stderr, "sending SCTP message failed\n");
-#endif
+  struct sctp_message msg;
+  msg.data = NULL;
+  msg.len = len;
+  msg.sid = sid;
+  msg.ppid = ppid;
+  msg.sent = 0;
+  msg.source = NULL;
+  if (len > 0) {
+    msg.data = malloc(len);
+    if (msg.data == NULL)
       return -1;
-    }
+    memcpy(msg.data, data, len);
+  }
 
-    return 0;
+  if (send_ring_push(&sctp->send_ring, &msg) < 0) {
+    free(msg.data);
+    return -1;
   }
+  if (sctp->wakeup)
+    g_main_context_wakeup(sctp->wakeup);
 
-  struct sctp_message *msg = (struct sctp_message *)calloc(1, sizeof *msg);
-  if (msg == NULL)
+  return 0;
+}
+
+// takes source, its chunk buffer is allocated here
+int
+send_sctp_stream(struct sctp_transport *sctp, struct sctp_stream_source *source)
+{
+  if (sctp == NULL || sctp->send_ring.slots == NULL || source == NULL)
     return -1;
 
-  msg->data = data;
-  msg->len = len;
-  msg->sid = sid;
-  msg->ppid = ppid;
-  g_async_queue_push(sctp->deferred_messages, msg);
+  source->chunk = (unsigned char *)malloc(RTCDC_STREAM_CHUNK_SIZE);
+  if (source->chunk == NULL)
+    return -1;
+
+  struct sctp_message msg;
+  memset(&msg, 0, sizeof msg);
+  msg.sid = source->sid;
+  msg.ppid = source->ppid;
+  msg.source = source;
+  if (send_ring_push(&sctp->send_ring, &msg) < 0) {
+    free(source->chunk);
+    source->chunk = NULL;
+    return -1;
+  }
 
+  if (sctp->wakeup)
+    g_main_context_wakeup(sctp->wakeup);
   return 0;
 }
@@ -15,40 +15,123 @@ extern "C" {
 
 struct rtcdc_peer_connection;
 
+struct rtcdc_data_channel;
+
+// a message sent piecewise with explicit EOR, owned by sctp_step once queued
+struct sctp_stream_source {
+  struct rtcdc_data_channel *channel;
+  uint16_t sid;
+  uint32_t ppid;
+  size_t total;
+  size_t sent;
+  int fd; // read from here unless it is -1
+  ssize_t (*read)(void *buf, size_t len, void *user_data);
+  void (*on_sent)(struct rtcdc_data_channel *channel, int status, void *user_data);
+  void *user_data;
+  unsigned char *chunk;
+  size_t chunk_len;
+  size_t chunk_off;
+  struct sctp_stream_source *next;
+};
+
 struct sctp_message {
   void *data;
   size_t len;
+  size_t sent; // accepted by usrsctp so far
   uint16_t sid;
   uint32_t ppid;
+  struct sctp_stream_source *source; // set instead of data for streamed sends
+};
+
+// bounded multi-producer single-consumer ring (Vyukov), the sequence
+// number of a slot tells producers and the consumer whose turn it is
+struct sctp_send_slot {
+  gint seq;
+  struct sctp_message msg;
+};
+
+struct sctp_send_ring {
+  struct sctp_send_slot *slots;
+  guint mask;
+  gint enqueue_pos;
+  guint dequeue_pos; // consumer only
+};
+
+// a message delivered in pieces (partial delivery, I-DATA interleaving)
+struct sctp_partial_message {
+  unsigned char *data;
+  size_t len;
+  gboolean discard; // too big, drop pieces until MSG_EOR
+};
+
+struct sctp_context {
+  struct socket *shared_sock;
+  int shared_port;
+  int shared_ref;
+  GMutex shared_mutex;
 };
 
 struct sctp_transport {
+  struct sctp_context *context;
   struct socket *sock;
+  sctp_assoc_t assoc_id;
+  gboolean one_to_many;
+  int scheduler;
   BIO *incoming_bio;
   BIO *outgoing_bio;
   int local_port;
   int remote_port;
+  size_t remote_max_message_size; // 0 means no limit
   gboolean handshake_done;
-  GAsyncQueue *deferred_messages;
+  gboolean assoc_failed; // went down before it was up, ends startup
+  struct sctp_send_ring send_ring; // filled by any thread, drained by sctp_thread
+  struct sctp_message *send_pending; // dequeued, waiting for send buffer space
+  struct sctp_stream_source *active_streams; // in queue order, consumer only
+  GHashTable *deferred; // sid -> GQueue of struct sctp_message *, behind a streamed send
+  guint deferred_count;
   GMutex sctp_mutex;
-#ifdef DEBUG_SCTP
-  int incoming_stub;
-  int outgoing_stub;
-#endif
+  struct capture *capture; // NULL unless rtcdc_start_capture is active
+  GMutex capture_mutex;
   int stream_cursor;
+  GHashTable *partial_messages; // sid -> struct sctp_partial_message
+  GMainContext *wakeup; // external loop to poke when output is pending
   void *user_data;
 };
 
+struct sctp_context *
+create_sctp_context(void);
+
+void
+destroy_sctp_context(struct sctp_context *context);
+
 struct sctp_transport *
 create_sctp_transport(struct rtcdc_peer_connection *peer);
 
+void
+abort_sctp_transport(struct sctp_transport *sctp);
+
 void
 destroy_sctp_transport(struct sctp_transport *sctp);
 
+void
+apply_sctp_scheduler(struct sctp_transport *sctp, struct socket *s, sctp_assoc_t assoc_id);
+
+int
+set_sctp_stream_priority(struct sctp_transport *sctp, uint16_t sid, uint16_t priority);
+
+void
+apply_sctp_stream_priorities(struct rtcdc_peer_connection *peer);
+
 int
 send_sctp_message(struct sctp_transport *sctp,
                   void *data, size_t len, uint16_t sid, uint32_t ppid);
 
+int
+sctp_step(struct rtcdc_peer_connection *peer);
+
+int
+send_sctp_stream(struct sctp_transport *sctp, struct sctp_stream_source *source);
+
 gpointer
 sctp_thread(gpointer peer);
 
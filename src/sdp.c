@@ -5,6 +5,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <strings.h>
 #include <glib.h>
 #include <agent.h>
 #include "common.h"
@@ -15,6 +18,146 @@
 #include "rtcdc.h"
 #include "sdp.h"
 
+void
+sdp_builder_init(struct sdp_builder *builder, char *buf, size_t size)
+{
+  builder->buf = buf;
+  builder->size = size;
+  builder->pos = 0;
+  builder->overflow = 0;
+  if (size > 0)
+    buf[0] = 0;
+}
+
+void
+sdp_append(struct sdp_builder *builder, const char *fmt, ...)
+{
+  if (builder->overflow)
+    return;
+
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(builder->buf + builder->pos, builder->size - builder->pos, fmt, ap);
+  va_end(ap);
+
+  if (n < 0 || (size_t)n >= builder->size - builder->pos)
+    builder->overflow = 1;
+  else
+    builder->pos += n;
+}
+
+// returns the next line (without its \r\n or \n) and advances the cursor,
+// NULL at the end; the line is not NUL-terminated
+const char *
+sdp_next_line(const char **cursor, size_t *len)
+{
+  const char *line = *cursor;
+  if (line == NULL || *line == 0)
+    return NULL;
+
+  const char *end = strchr(line, '\n');
+  if (end == NULL) {
+    *len = strlen(line);
+    *cursor = line + *len;
+  } else {
+    *len = end - line;
+    *cursor = end + 1;
+  }
+  if (*len > 0 && line[*len - 1] == '\r')
+    (*len)--;
+
+  return line;
+}
+
+static int
+line_has_prefix(const char *line, size_t len, const char *prefix, size_t plen)
+{
+  return len >= plen && memcmp(line, prefix, plen) == 0;
+}
+
+static int
+copy_value(char *dest, size_t size, const char *value, size_t len)
+{
+  if (len >= size)
+    return -1;
+  memcpy(dest, value, len);
+  dest[len] = 0;
+  return 0;
+}
+
+// decimal value after the attribute name, -1 if it exceeds max
+static int
+parse_number(const char *line, size_t len, size_t start, size_t max, size_t *out)
+{
+  size_t value = 0;
+  for (size_t i = start; i < len && line[i] >= '0' && line[i] <= '9'; ++i) {
+    size_t digit = line[i] - '0';
+    if (value > (max - digit) / 10)
+      return -1;
+    value = value * 10 + digit;
+  }
+  *out = value;
+  return 0;
+}
+
+#define SDP_ATTR(line, len, name) line_has_prefix(line, len, name, sizeof name - 1)
+
+int
+parse_sdp(const char *sdp, struct sdp_description *desc)
+{
+  if (sdp == NULL || desc == NULL)
+    return -1;
+
+  memset(desc, 0, sizeof *desc);
+
+  const char *cursor = sdp;
+  const char *line;
+  size_t len;
+  while ((line = sdp_next_line(&cursor, &len))) {
+    if (len < 2 || line[0] != 'a' || line[1] != '=')
+      continue;
+
+    if (SDP_ATTR(line, len, "a=candidate:")) {
+      desc->candidate_count++;
+    } else if (SDP_ATTR(line, len, "a=sctp-port:")) {
+      size_t port;
+      if (parse_number(line, len, sizeof "a=sctp-port:" - 1, 65535, &port) < 0 || port == 0)
+        return -1;
+      desc->sctp_port = port;
+    } else if (SDP_ATTR(line, len, "a=setup:")) {
+      const char *value = line + sizeof "a=setup:" - 1;
+      size_t vlen = len - (sizeof "a=setup:" - 1);
+      if (vlen == 6 && memcmp(value, "active", 6) == 0)
+        desc->setup = SDP_SETUP_ACTIVE;
+      else if (vlen == 7 && memcmp(value, "passive", 7) == 0)
+        desc->setup = SDP_SETUP_PASSIVE;
+      else
+        desc->setup = SDP_SETUP_ACTPASS;
+    } else if (SDP_ATTR(line, len, "a=fingerprint:")) {
+      const char *value = line + sizeof "a=fingerprint:" - 1;
+      size_t vlen = len - (sizeof "a=fingerprint:" - 1);
+      if (vlen > 8 && strncasecmp(value, "sha-256 ", 8) == 0)
+        copy_value(desc->fingerprint, sizeof desc->fingerprint, value + 8, vlen - 8);
+    } else if (SDP_ATTR(line, len, "a=max-message-size:")) {
+      size_t size;
+      if (parse_number(line, len, sizeof "a=max-message-size:" - 1, SIZE_MAX, &size) < 0)
+        return -1;
+      desc->max_message_size = size;
+      desc->has_max_message_size = 1;
+    } else if (SDP_ATTR(line, len, "a=ice-ufrag:")) {
+      if (copy_value(desc->ice_ufrag, sizeof desc->ice_ufrag,
+                     line + sizeof "a=ice-ufrag:" - 1, len - (sizeof "a=ice-ufrag:" - 1)) < 0)
+        return -1;
+    } else if (SDP_ATTR(line, len, "a=ice-pwd:")) {
+      if (copy_value(desc->ice_pwd, sizeof desc->ice_pwd,
+                     line + sizeof "a=ice-pwd:" - 1, len - (sizeof "a=ice-pwd:" - 1)) < 0)
+        return -1;
+    }
+  }
+
+  return 0;
+}
+
 char *
 generate_local_sdp(struct rtcdc_transport *transport, int client)
 {
@@ -26,75 +169,107 @@ generate_local_sdp(struct rtcdc_transport *transport, int client)
   struct dtls_context *ctx = transport->ctx;
 
   char buf[BUFFER_SIZE];
-  memset(buf, 0, sizeof buf);
+  struct sdp_builder builder;
+  sdp_builder_init(&builder, buf, sizeof buf);
 
   char sessid[SESSION_ID_SIZE + 1];
   memset(sessid, 0, sizeof sessid);
   random_number_string(sessid, SESSION_ID_SIZE);
 
-  int pos = sprintf(buf, "v=0\r\n");
-  pos += sprintf(buf + pos, "o=- %s 2 IN IP4 127.0.0.1\r\n", sessid);
-  pos += sprintf(buf + pos, "%s",
+  gchar *ufrag = NULL, *pwd = NULL;
+  if (!nice_agent_get_local_credentials(ice->agent, ice->stream_id, &ufrag, &pwd))
+    return NULL;
+
+  sdp_append(&builder,
+    "v=0\r\n"
+    "o=- %s 2 IN IP4 127.0.0.1\r\n"
     "s=-\r\n"
     "t=0 0\r\n"
-    "a=msid-semantic: WMS\r\n");
-  pos += sprintf(buf + pos, "m=application 1 UDP/DTLS/SCTP webrtc-datachannel\r\n");
-  pos += sprintf(buf + pos, "c=IN IP4 0.0.0.0\r\n");
-
-  gchar *lsdp = nice_agent_generate_local_sdp(ice->agent);
-  gchar **lines = g_strsplit(lsdp, "\n", 0);
-  g_free(lsdp);
-  for (int i = 0; lines && lines[i]; ++i) {
-    if (g_str_has_prefix(lines[i], "a=ice-ufrag:")
-        || g_str_has_prefix(lines[i], "a=ice-pwd:")) {
-      pos += sprintf(buf + pos, "%s\r\n", lines[i]);
-    }
-  }
-  g_strfreev(lines);
-
-  pos += sprintf(buf + pos, "a=fingerprint:sha-256 %s\r\n", ctx->fingerprint);
-
-  if (client)
-    pos += sprintf(buf + pos, "a=setup:active\r\n");
-  else
-    pos += sprintf(buf + pos, "a=setup:passive\r\n");
-
-  pos += sprintf(buf + pos, "a=mid:data\r\n");
-  pos += sprintf(buf + pos, "a=sctp-port:%d\r\n", sctp->local_port);
+    "a=msid-semantic: WMS\r\n"
+    "m=application 1 UDP/DTLS/SCTP webrtc-datachannel\r\n"
+    "c=IN IP4 0.0.0.0\r\n"
+    "a=ice-ufrag:%s\r\n"
+    "a=ice-pwd:%s\r\n"
+    "a=fingerprint:sha-256 %s\r\n"
+    "a=setup:%s\r\n"
+    "a=mid:data\r\n"
+    "a=sctp-port:%d\r\n"
+    "a=max-message-size:%d\r\n",
+    sessid, ufrag, pwd, ctx->fingerprint,
+    client ? "active" : "passive",
+    sctp->local_port,
+    RTCDC_MAX_MESSAGE_SIZE);
+  g_free(ufrag);
+  g_free(pwd);
 
-  return strndup(buf, pos);
+  if (builder.overflow)
+    return NULL;
+  return strndup(buf, builder.pos);
 }
 
 char *
-generate_local_candidate_sdp(struct rtcdc_transport *transport)
+generate_local_candidate_sdp(struct rtcdc_transport *transport, int relay_only)
 {
   if (transport == NULL || transport->ice == NULL)
     return NULL;
 
+  struct ice_transport *ice = transport->ice;
+
   char buf[BUFFER_SIZE];
-  memset(buf, 0, sizeof buf);
-
-  gchar *lsdp = nice_agent_generate_local_sdp(transport->ice->agent);
-  gchar **lines = g_strsplit(lsdp, "\n", 0);
-  g_free(lsdp);
-  int pos = 0;
-  for (int i = 0; lines && lines[i]; ++i) {
-    if (g_str_has_prefix(lines[i], "a=candidate:")) {
-      pos += sprintf(buf + pos, "%s\r\n", lines[i]);
-    }
+  struct sdp_builder builder;
+  sdp_builder_init(&builder, buf, sizeof buf);
+
+  GSList *candidates = nice_agent_get_local_candidates(ice->agent, ice->stream_id, 1);
+  for (GSList *i = candidates; i; i = i->next) {
+    NiceCandidate *cand = (NiceCandidate *)i->data;
+    if (relay_only && cand->type != NICE_CANDIDATE_TYPE_RELAYED)
+      continue;
+    gchar *line = nice_agent_generate_local_candidate_sdp(ice->agent, cand);
+    sdp_append(&builder, "%s\r\n", line);
+    g_free(line);
   }
-  g_strfreev(lines);
+  g_slist_free_full(candidates, (GDestroyNotify)&nice_candidate_free);
 
-  return strndup(buf, pos);
+  if (builder.overflow)
+    return NULL;
+  return strndup(buf, builder.pos);
 }
 
 int
-parse_remote_sdp(struct ice_transport *ice, const char *rsdp)
+parse_remote_sdp(struct ice_transport *ice, const struct sdp_description *desc,
+                 const char *rsdp)
 {
-  if (ice == NULL || ice->agent == NULL || rsdp == NULL)
+  if (ice == NULL || ice->agent == NULL || desc == NULL || rsdp == NULL)
+    return -1;
+
+  if (desc->ice_ufrag[0] == 0 || desc->ice_pwd[0] == 0)
+    return -1;
+  if (!nice_agent_set_remote_credentials(ice->agent, ice->stream_id,
+                                         desc->ice_ufrag, desc->ice_pwd))
     return -1;
-  
-  return nice_agent_parse_remote_sdp(ice->agent, rsdp);
+
+  if (desc->candidate_count == 0)
+    return 0;
+
+  // candidates embedded in the offer, handed to the agent in one go
+  char line[BUFFER_SIZE];
+  GSList *list = NULL;
+  const char *cursor = rsdp;
+  const char *l;
+  size_t len;
+  while ((l = sdp_next_line(&cursor, &len))) {
+    if (!SDP_ATTR(l, len, "a=candidate:") || copy_value(line, sizeof line, l, len) < 0)
+      continue;
+    NiceCandidate *rcand = nice_agent_parse_remote_candidate_sdp(ice->agent, ice->stream_id, line);
+    if (rcand)
+      list = g_slist_prepend(list, rcand);
+  }
+  list = g_slist_reverse(list);
+
+  int ret = nice_agent_set_remote_candidates(ice->agent, ice->stream_id, 1, list);
+  g_slist_free_full(list, (GDestroyNotify)&nice_candidate_free);
+
+  return ret;
 }
 
 int
@@ -103,20 +278,54 @@ parse_remote_candidate_sdp(struct ice_transport *ice, const char *candidates)
   if (ice == NULL || ice->agent == NULL || candidates == NULL)
     return -1;
 
-  char **lines;
-  lines = g_strsplit(candidates, "\r\n", 0);
-
+  char line[BUFFER_SIZE];
   GSList *list = NULL;
-  for (int i = 0; lines && lines[i]; ++i) {
-    NiceCandidate *rcand = nice_agent_parse_remote_candidate_sdp(ice->agent, ice->stream_id, lines[i]);
+  const char *cursor = candidates;
+  const char *l;
+  size_t len;
+  while ((l = sdp_next_line(&cursor, &len))) {
+    if (copy_value(line, sizeof line, l, len) < 0)
+      continue;
+    NiceCandidate *rcand = nice_agent_parse_remote_candidate_sdp(ice->agent, ice->stream_id, line);
     if (rcand == NULL)
       continue;
-    list = g_slist_append(list, rcand);
+    list = g_slist_prepend(list, rcand);
   }
-  g_strfreev(lines);
+  list = g_slist_reverse(list);
 
   int ret = nice_agent_set_remote_candidates(ice->agent, ice->stream_id, 1, list);
   g_slist_free_full(list, (GDestroyNotify)&nice_candidate_free);
 
   return ret;
 }
+
+int
+add_remote_candidate_sdp(struct ice_transport *ice, const char *candidate)
+{
+  if (ice == NULL || ice->agent == NULL || candidate == NULL)
+    return -1;
+
+  // an empty candidate is the trickle end-of-candidates indication
+  if (strcmp(candidate, "") == 0 || g_str_has_prefix(candidate, "a=end-of-candidates"))
+    return nice_agent_peer_candidate_gathering_done(ice->agent, ice->stream_id) ? 0 : -1;
+
+  // browsers trickle the attribute value without the "a=" prefix
+  char buf[BUFFER_SIZE];
+  if (!g_str_has_prefix(candidate, "a=")) {
+    int n = snprintf(buf, sizeof buf, "a=%s", candidate);
+    if (n < 0 || (size_t)n >= sizeof buf)
+      return -1;
+    candidate = buf;
+  }
+
+  NiceCandidate *rcand = nice_agent_parse_remote_candidate_sdp(ice->agent, ice->stream_id, candidate);
+  if (rcand == NULL)
+    return -1;
+
+  // added on its own, connectivity checks for it start right away
+  GSList list = { rcand, NULL };
+  int ret = nice_agent_set_remote_candidates(ice->agent, ice->stream_id, 1, &list);
+  nice_candidate_free(rcand);
+
+  return ret;
+}
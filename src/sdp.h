@@ -9,21 +9,68 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+#include "dtls.h"
+
+#define SDP_MAX_ICE_VALUE_SIZE (256 + 1)
+
+#define SDP_SETUP_UNKNOWN 0
+#define SDP_SETUP_ACTPASS 1
+#define SDP_SETUP_ACTIVE  2
+#define SDP_SETUP_PASSIVE 3
+
 struct rtcdc_transport;
 struct ice_transport;
 
+// fixed-size buffer writer, overflow is sticky and checked once at the end
+struct sdp_builder {
+  char *buf;
+  size_t size;
+  size_t pos;
+  int overflow;
+};
+
+// the attributes librtcdc cares about, filled by a single pass over the SDP
+struct sdp_description {
+  int sctp_port;
+  int setup;
+  char fingerprint[SHA256_FINGERPRINT_SIZE]; // sha-256 only
+  size_t max_message_size;
+  int has_max_message_size;
+  char ice_ufrag[SDP_MAX_ICE_VALUE_SIZE];
+  char ice_pwd[SDP_MAX_ICE_VALUE_SIZE];
+  int candidate_count;
+};
+
+void
+sdp_builder_init(struct sdp_builder *builder, char *buf, size_t size);
+
+void
+sdp_append(struct sdp_builder *builder, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+const char *
+sdp_next_line(const char **cursor, size_t *len);
+
+int
+parse_sdp(const char *sdp, struct sdp_description *desc);
+
 char *
 generate_local_sdp(struct rtcdc_transport *transport, int client);
 
 char *
-generate_local_candidate_sdp(struct rtcdc_transport *transport);
+generate_local_candidate_sdp(struct rtcdc_transport *transport, int relay_only);
 
 int
-parse_remote_sdp(struct ice_transport *ice, const char *rsdp);
+parse_remote_sdp(struct ice_transport *ice, const struct sdp_description *desc,
+                 const char *rsdp);
 
 int
 parse_remote_candidate_sdp(struct ice_transport *ice, const char *candidates);
 
+int
+add_remote_candidate_sdp(struct ice_transport *ice, const char *candidate);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -0,0 +1,321 @@
+// turn_test.c
+// Copyright (c) 2015 Xiaohan Song <chef@dark.kitchen>
+// This file is licensed under a BSD license.
+
+// Gathers candidates of a peer with RTCDC_ICE_POLICY_RELAY against a local
+// TURN stand-in, built and run with `make check`. The stand-in answers the
+// first Allocate with a 401 challenge and the authenticated one with a
+// relayed address; the test passes when the peer authenticated with the
+// configured credentials and signalled relayed candidates only.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <glib.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include "rtcdc.h"
+
+#define TURN_USERNAME "rtcdc"
+#define TURN_PASSWORD "secret"
+#define TURN_REALM    "example.org"
+#define TURN_NONCE    "f00dfeedf00dfeed"
+
+#define STUN_MAGIC_COOKIE 0x2112A442
+#define STUN_HEADER_SIZE  20
+
+#define STUN_ALLOCATE_REQUEST  0x0003
+#define STUN_ALLOCATE_SUCCESS  0x0103
+#define STUN_ALLOCATE_ERROR    0x0113
+
+#define STUN_ATTR_USERNAME            0x0006
+#define STUN_ATTR_MESSAGE_INTEGRITY   0x0008
+#define STUN_ATTR_ERROR_CODE          0x0009
+#define STUN_ATTR_LIFETIME            0x000D
+#define STUN_ATTR_REALM               0x0014
+#define STUN_ATTR_NONCE               0x0015
+#define STUN_ATTR_XOR_RELAYED_ADDRESS 0x0016
+#define STUN_ATTR_XOR_MAPPED_ADDRESS  0x0020
+
+#define GATHER_TIMEOUT_US (10 * G_USEC_PER_SEC)
+
+struct turn_standin {
+  int sock;
+  uint16_t port;
+  volatile int stop;
+  int challenged;    // Allocates answered with 401
+  int authenticated; // Allocates with the configured USERNAME and a valid integrity
+  int bad_requests;  // Allocates with a nonce but wrong credentials
+};
+
+struct gather_result {
+  int relayed;
+  int direct; // host, server or peer reflexive
+  gboolean done;
+};
+
+struct stun_message {
+  unsigned char buf[1024];
+  size_t len;
+};
+
+static uint16_t
+get16(const unsigned char *p)
+{
+  return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static void
+put16(unsigned char *p, uint16_t v)
+{
+  p[0] = v >> 8;
+  p[1] = v & 0xff;
+}
+
+static void
+put32(unsigned char *p, uint32_t v)
+{
+  put16(p, v >> 16);
+  put16(p + 2, v & 0xffff);
+}
+
+// value of the first attr in msg, NULL if absent
+static const unsigned char *
+find_attribute(const unsigned char *msg, size_t len, uint16_t type, uint16_t *attr_len)
+{
+  size_t pos = STUN_HEADER_SIZE;
+  while (pos + 4 <= len) {
+    uint16_t t = get16(msg + pos);
+    uint16_t l = get16(msg + pos + 2);
+    if (pos + 4 + l > len)
+      return NULL;
+    if (t == type) {
+      *attr_len = l;
+      return msg + pos + 4;
+    }
+    pos += 4 + ((l + 3) & ~3);
+  }
+  return NULL;
+}
+
+static void
+start_response(struct stun_message *m, uint16_t type, const unsigned char *request)
+{
+  put16(m->buf, type);
+  put16(m->buf + 2, 0);
+  memcpy(m->buf + 4, request + 4, 16); // cookie and transaction id
+  m->len = STUN_HEADER_SIZE;
+}
+
+static void
+add_attribute(struct stun_message *m, uint16_t type, const void *value, uint16_t len)
+{
+  put16(m->buf + m->len, type);
+  put16(m->buf + m->len + 2, len);
+  memcpy(m->buf + m->len + 4, value, len);
+  memset(m->buf + m->len + 4 + len, 0, ((len + 3) & ~3) - len);
+  m->len += 4 + ((len + 3) & ~3);
+  put16(m->buf + 2, m->len - STUN_HEADER_SIZE);
+}
+
+static void
+add_xor_address(struct stun_message *m, uint16_t type, const struct sockaddr_in *addr)
+{
+  unsigned char value[8];
+  value[0] = 0;
+  value[1] = 0x01; // IPv4
+  put16(value + 2, ntohs(addr->sin_port) ^ (STUN_MAGIC_COOKIE >> 16));
+  put32(value + 4, ntohl(addr->sin_addr.s_addr) ^ STUN_MAGIC_COOKIE);
+  add_attribute(m, type, value, sizeof value);
+}
+
+// long-term credentials, RFC 5389 section 15.4
+static void
+long_term_key(unsigned char key[16])
+{
+  const char *creds = TURN_USERNAME ":" TURN_REALM ":" TURN_PASSWORD;
+  EVP_Digest(creds, strlen(creds), key, NULL, EVP_md5(), NULL);
+}
+
+// HMAC-SHA1 over msg up to an integrity attribute at offset, with the
+// header length counting that attribute
+static void
+message_integrity(const unsigned char *msg, size_t offset, unsigned char mac[20])
+{
+  unsigned char copy[1024];
+  unsigned char key[16];
+  memcpy(copy, msg, offset);
+  put16(copy + 2, offset + 24 - STUN_HEADER_SIZE);
+  long_term_key(key);
+  HMAC(EVP_sha1(), key, sizeof key, copy, offset, mac, NULL);
+}
+
+static gboolean
+check_credentials(const unsigned char *msg, size_t len)
+{
+  uint16_t n;
+  const unsigned char *username = find_attribute(msg, len, STUN_ATTR_USERNAME, &n);
+  if (username == NULL || n != strlen(TURN_USERNAME) || memcmp(username, TURN_USERNAME, n) != 0)
+    return FALSE;
+
+  const unsigned char *mi = find_attribute(msg, len, STUN_ATTR_MESSAGE_INTEGRITY, &n);
+  if (mi == NULL || n != 20)
+    return FALSE;
+  unsigned char mac[20];
+  message_integrity(msg, mi - 4 - msg, mac);
+  return memcmp(mac, mi, sizeof mac) == 0;
+}
+
+static void
+handle_allocate(struct turn_standin *turn, const unsigned char *msg, size_t len,
+                const struct sockaddr_in *from)
+{
+  struct stun_message res;
+  uint16_t n;
+  if (find_attribute(msg, len, STUN_ATTR_NONCE, &n) == NULL) {
+    unsigned char error[4 + 12] = { 0, 0, 4, 1 };
+    memcpy(error + 4, "Unauthorized", 12);
+    start_response(&res, STUN_ALLOCATE_ERROR, msg);
+    add_attribute(&res, STUN_ATTR_ERROR_CODE, error, sizeof error);
+    add_attribute(&res, STUN_ATTR_REALM, TURN_REALM, strlen(TURN_REALM));
+    add_attribute(&res, STUN_ATTR_NONCE, TURN_NONCE, strlen(TURN_NONCE));
+    turn->challenged++;
+  } else if (check_credentials(msg, len)) {
+    struct sockaddr_in relayed;
+    memset(&relayed, 0, sizeof relayed);
+    relayed.sin_family = AF_INET;
+    relayed.sin_port = htons(turn->port + 1);
+    relayed.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    unsigned char lifetime[4];
+    put32(lifetime, 600);
+    start_response(&res, STUN_ALLOCATE_SUCCESS, msg);
+    add_xor_address(&res, STUN_ATTR_XOR_RELAYED_ADDRESS, &relayed);
+    add_xor_address(&res, STUN_ATTR_XOR_MAPPED_ADDRESS, from);
+    add_attribute(&res, STUN_ATTR_LIFETIME, lifetime, sizeof lifetime);
+    unsigned char mac[20];
+    message_integrity(res.buf, res.len, mac);
+    add_attribute(&res, STUN_ATTR_MESSAGE_INTEGRITY, mac, sizeof mac);
+    turn->authenticated++;
+  } else {
+    turn->bad_requests++;
+    return;
+  }
+
+  sendto(turn->sock, res.buf, res.len, 0, (const struct sockaddr *)from, sizeof *from);
+}
+
+// only Allocate is answered; refreshes and permissions are never needed
+// before the test ends
+static gpointer
+turn_thread(gpointer user_data)
+{
+  struct turn_standin *turn = (struct turn_standin *)user_data;
+  unsigned char msg[1024];
+  while (!turn->stop) {
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof from;
+    ssize_t len = recvfrom(turn->sock, msg, sizeof msg, 0, (struct sockaddr *)&from, &from_len);
+    if (len < STUN_HEADER_SIZE || from.sin_family != AF_INET)
+      continue;
+    if (get16(msg) == STUN_ALLOCATE_REQUEST
+        && (uint32_t)(msg[4] << 24 | msg[5] << 16 | msg[6] << 8 | msg[7]) == STUN_MAGIC_COOKIE)
+      handle_allocate(turn, msg, len, &from);
+  }
+  return NULL;
+}
+
+static int
+start_turn_standin(struct turn_standin *turn)
+{
+  memset(turn, 0, sizeof *turn);
+  turn->sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (turn->sock < 0)
+    return -1;
+
+  // lets the thread notice stop
+  struct timeval tv = { 0, 100000 };
+  setsockopt(turn->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(turn->sock, (struct sockaddr *)&addr, sizeof addr) < 0
+      || getsockname(turn->sock, (struct sockaddr *)&addr, &addr_len) < 0) {
+    close(turn->sock);
+    return -1;
+  }
+  turn->port = ntohs(addr.sin_port);
+  return 0;
+}
+
+static void
+on_candidate(struct rtcdc_peer_connection *peer, const char *candidate, void *user_data)
+{
+  struct gather_result *result = (struct gather_result *)user_data;
+  if (strcmp(candidate, "") == 0)
+    result->done = TRUE;
+  else if (strstr(candidate, " typ relay"))
+    result->relayed++;
+  else
+    result->direct++;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct turn_standin turn;
+  if (start_turn_standin(&turn) < 0) {
+    perror("TURN stand-in");
+    return 1;
+  }
+  GThread *thread = g_thread_new("TURN stand-in", turn_thread, &turn);
+
+  struct gather_result result;
+  memset(&result, 0, sizeof result);
+  struct rtcdc_context *ctx = rtcdc_create_context();
+  if (ctx == NULL)
+    abort();
+  rtcdc_use_external_loop(ctx);
+  struct rtcdc_peer_connection *peer =
+    rtcdc_create_peer_connection(ctx, NULL, on_candidate, NULL, NULL, 0, &result);
+  if (peer == NULL
+      || rtcdc_set_ice_policy(peer, RTCDC_ICE_POLICY_RELAY) < 0
+      || rtcdc_add_turn_server(peer, "127.0.0.1", turn.port,
+                               TURN_USERNAME, TURN_PASSWORD, RTCDC_TURN_UDP) < 0)
+    abort();
+
+  char *offer = rtcdc_generate_offer_sdp(peer);
+  if (offer == NULL)
+    abort();
+  free(offer);
+
+  gint64 deadline = g_get_monotonic_time() + GATHER_TIMEOUT_US;
+  while (!result.done && g_get_monotonic_time() < deadline) {
+    rtcdc_process_events(ctx);
+    g_usleep(10000);
+  }
+
+  rtcdc_destroy_peer_connection(peer);
+  rtcdc_destroy_context(ctx);
+  turn.stop = 1;
+  g_thread_join(thread);
+  close(turn.sock);
+
+  printf("challenged %d, authenticated %d, bad requests %d, "
+         "relayed candidates %d, direct candidates %d%s\n",
+         turn.challenged, turn.authenticated, turn.bad_requests,
+         result.relayed, result.direct, result.done ? "" : ", gathering timed out");
+
+  int ok = turn.challenged > 0 && turn.authenticated > 0 && turn.bad_requests == 0
+           && result.relayed > 0 && result.direct == 0 && result.done;
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}